@@ -22,424 +22,1882 @@
 //	* singlestep debugging seems to mess up synchronization in connectMobile()
 //
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#endif
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NETMON_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NETMON_SSE2
+#endif
 #include "libNokiaNetmon.h"
+#include "libNokiaNetmonInternal.h"
 
 
+#ifndef _WIN32
+// the secure CRT function used below is MSVC only
+#define sprintf_s snprintf
+#endif
+
 // global variables
-HANDLE comHandles[128];		// stored handles for up to 128 COM ports
-unsigned int seqNumber[4] = { 0x40, 0x40, 0x40, 0x40 };		// starting sequence numbers per COM port
+MOBILE *mobiles[128];		// phones opened under a COM port number (see connectMobile())
+
+
+//	Serial Port Backend
+
+
+//	DWORD _getTicks(void)
+//	Description: returns a monotonic timestamp in miliseconds, used for timeouts
+//	Return Value: miliseconds since an arbitrary starting point
+
+DWORD _getTicks(void)
+{
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (DWORD)(ts.tv_sec*1000 + ts.tv_nsec/1000000);
+#endif
+}
+
+
+//	ERRORS _openPort(const char *device, PORT *dest)
+//	Description: opens a serial device and configures it for FBUS (115200 baud,
+//	8N1, no flow control, DTR set, RTS cleared)
+//	Parameters:
+//		device		name of the device (e.g. \\.\COM1 or /dev/ttyS0)
+//		dest		pointer to a PORT being filled with the opened handle
+//	Return Value: SUCCESS (0) or an error code as specified in ERROR (libNokiaNetmon.h)
+
+ERRORS _openPort(const char *device, PORT *dest)
+{
+#ifdef _WIN32
+	DCB dcb;
+	HANDLE handle;
+
+	// create file
+	handle = CreateFile(device, GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		return E_CANTOPENPORT;	// error cannot open COM port
+
+	// probe COM state in order to fill the DCB struct
+	if (!GetCommState(handle, &dcb))
+	{
+		CloseHandle(handle);
+		return E_GETPORTSTATE;	// error: cannot get COM port state
+	}
+
+	dcb.DCBlength = sizeof(DCB);
+	// fill Nokia 3310 specific parameters in struct
+	dcb.BaudRate = CBR_115200;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	// flow control (setting fDtrControl is necessary, not sure about the others)
+	dcb.fOutxDsrFlow = 0;
+	dcb.fDtrControl = DTR_CONTROL_ENABLE;
+	dcb.fOutxCtsFlow = 0;
+	dcb.fRtsControl = DTR_CONTROL_DISABLE;
+	dcb.fInX = 0;
+	dcb.fOutX = 0;
+
+	// set COM state
+	if (!SetCommState(handle, &dcb))
+	{
+		CloseHandle(handle);
+		return E_SETPORTSTATE;	// error: cannot set COM port state
+	}
+
+	*dest = handle;
+#else
+	struct termios tio;
+	int fd, bits;
+
+	fd = open(device, O_RDWR|O_NOCTTY|O_NONBLOCK);
+	if (fd == -1)
+		return E_CANTOPENPORT;	// error: cannot open tty
+	if (fd == 0)
+	{
+		// stdin was closed, move away from 0 which marks unused ports
+		int fd2 = fcntl(fd, F_DUPFD, 1);
+		close(fd);
+		if (fd2 == -1)
+			return E_CANTOPENPORT;
+		fd = fd2;
+	}
+
+	if (tcgetattr(fd, &tio) == -1)
+	{
+		close(fd);
+		return E_GETPORTSTATE;	// error: cannot get tty attributes
+	}
+
+	// raw 115200 8N1, no flow control
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, B115200);
+	cfsetospeed(&tio, B115200);
+	tio.c_cflag &= ~(CSIZE|PARENB|CSTOPB|CRTSCTS);
+	tio.c_cflag |= CS8|CLOCAL|CREAD;
+	tio.c_iflag &= ~(IXON|IXOFF|IXANY);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+
+	if (tcsetattr(fd, TCSANOW, &tio) == -1)
+	{
+		close(fd);
+		return E_SETPORTSTATE;	// error: cannot set tty attributes
+	}
+
+	// the cable is powered by DTR, RTS stays low (fails harmlessly on ptys)
+	bits = TIOCM_DTR;
+	ioctl(fd, TIOCMBIS, &bits);
+	bits = TIOCM_RTS;
+	ioctl(fd, TIOCMBIC, &bits);
+
+	tcflush(fd, TCIOFLUSH);
+
+	*dest = fd;
+#endif
+
+	return SUCCESS;
+}
+
+
+//	void _closePort(PORT handle)
+//	Description: closes a port opened by _openPort()
+//	Parameters:
+//		handle		handle of the port
+
+void _closePort(PORT handle)
+{
+#ifdef _WIN32
+	CloseHandle(handle);
+#else
+	close(handle);
+#endif
+}
+
+
+//	bool _writePort(MOBILE *mobile, const char *buf, unsigned long len)
+//	Description: writes a number of bytes to an opened port
+//	Parameters:
+//		mobile		connected phone
+//		buf			bytes to write
+//		len			number of bytes
+//	Return Value: true if all bytes have been written
+
+bool _writePort(MOBILE *mobile, const char *buf, unsigned long len)
+{
+#ifdef _WIN32
+	DWORD dwBytesWritten;
+
+	if (!WriteFile(mobile->handle, buf, len, &dwBytesWritten, NULL))
+		return false;
+	return (dwBytesWritten == len);
+#else
+	struct pollfd pfd;
+	ssize_t ret;
+
+	while (len)
+	{
+		ret = write(mobile->handle, buf, len);
+		if (ret > 0)
+		{
+			buf += ret;
+			len -= ret;
+		}
+		else if (ret == -1 && errno == EAGAIN)
+		{
+			// output buffer full, wait until the UART drained some bytes
+			pfd.fd = mobile->handle;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, TIMEOUT) <= 0)
+				return false;
+		}
+		else if (ret == -1 && errno != EINTR)
+			return false;
+	}
+	return true;
+#endif
+}
+
+
+//	unsigned long _waitInput(MOBILE *mobile, DWORD dwDeadline)
+//	Description: blocks until there are bytes in the input buffer of a port or
+//	the deadline has passed
+//	Parameters:
+//		mobile		connected phone
+//		dwDeadline	point in time (as returned by _getTicks()) to give up
+//	Return Value: number of bytes that can be read without blocking, 0 if a
+//	timeout occured
+//	Notes: The Win32 version polls the input queue every 10 miliseconds, the
+//	POSIX version sleeps in poll() and returns as soon as data arrives.
+
+unsigned long _waitInput(MOBILE *mobile, DWORD dwDeadline)
+{
+#ifdef _WIN32
+	COMSTAT comstat;
+
+	do
+	{
+		Sleep(10);
+		ClearCommError(mobile->handle, NULL, &comstat);
+
+		// return if timeout occured
+		if ((long)(_getTicks() - dwDeadline) > 0)
+			return 0;
+	}
+	while (comstat.cbInQue == 0);
+
+	return comstat.cbInQue;
+#else
+	struct pollfd pfd;
+	long remaining;
+	int ret, avail;
+
+	pfd.fd = mobile->handle;
+	pfd.events = POLLIN;
+
+	do
+	{
+		remaining = (long)(dwDeadline - _getTicks());
+		if (remaining < 0)
+			return 0;		// timeout occured
+
+		ret = poll(&pfd, 1, (int)remaining);
+		if (ret == -1 && errno != EINTR)
+			return 0;
+		if (ret > 0)
+		{
+			if (pfd.revents & (POLLERR|POLLHUP|POLLNVAL) && !(pfd.revents & POLLIN))
+				return 0;	// device went away
+			if (ioctl(pfd.fd, FIONREAD, &avail) == 0 && avail > 0)
+				return (unsigned long)avail;
+		}
+	}
+	while (true);
+#endif
+}
+
+
+//	unsigned long _readPort(MOBILE *mobile, char *buf, unsigned long len)
+//	Description: reads bytes which are already in the input buffer of a port
+//	Parameters:
+//		mobile		connected phone
+//		buf			destination
+//		len			maximum number of bytes to read
+//	Return Value: number of bytes read
+
+unsigned long _readPort(MOBILE *mobile, char *buf, unsigned long len)
+{
+#ifdef _WIN32
+	DWORD dwBytesRead;
+
+	if (!ReadFile(mobile->handle, buf, len, &dwBytesRead, NULL))
+		return 0;
+	return dwBytesRead;
+#else
+	ssize_t ret;
+
+	do
+		ret = read(mobile->handle, buf, len);
+	while (ret == -1 && errno == EINTR);
+
+	return (ret > 0) ? (unsigned long)ret : 0;
+#endif
+}
+
+
+//	Internal Functions
+
+
+//	unsigned short _checksum(const void *buf, unsigned int len)
+//	Description: calculates both FBUS checksums of a frame at once. The XOR of
+//	all even bytes and of all odd bytes is the XOR of all 16 bit words, so the
+//	frame is folded 32 (AVX2), 16 (SSE2) or 8 bytes at a time and the result
+//	is reduced to one word.
+//	Parameters:
+//		buf			frame, starting with the frame id
+//		len			number of bytes (everything before the checksums)
+//	Return Value: XOR of the even bytes in the low byte, of the odd bytes in
+//	the high byte
+
+unsigned short _checksum(const void *buf, unsigned int len)
+{
+	const unsigned char *pBuf = (const unsigned char*)buf;
+	unsigned long long w = 0;
+	unsigned short chk;
+	unsigned int i = 0;
+
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#if defined(NETMON_AVX2)
+	if (len >= 32)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		for (; i+32 <= len; i += 32)
+			acc = _mm256_xor_si256(acc, _mm256_loadu_si256((const __m256i*)(pBuf+i)));
+		__m128i x = _mm_xor_si128(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		unsigned long long lanes[2];
+		_mm_storeu_si128((__m128i*)lanes, x);
+		w = lanes[0] ^ lanes[1];
+	}
+#elif defined(NETMON_SSE2)
+	if (len >= 16)
+	{
+		__m128i acc = _mm_setzero_si128();
+		for (; i+16 <= len; i += 16)
+			acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i*)(pBuf+i)));
+		unsigned long long lanes[2];
+		_mm_storeu_si128((__m128i*)lanes, acc);
+		w = lanes[0] ^ lanes[1];
+	}
+#endif
+	for (; i+8 <= len; i += 8)
+	{
+		unsigned long long v;
+		memcpy(&v, pBuf+i, 8);	// unaligned load
+		w ^= v;
+	}
+	// words start at even offsets, so even bytes end up in the low byte (little endian)
+	w ^= w >> 32;
+	w ^= w >> 16;
+#endif
+	chk = (unsigned short)w;
+	for (; i<len; i++)
+		chk ^= (unsigned short)(pBuf[i] << ((i & 1) * 8));
+
+	return chk;
+}
+
+
+//	void _sendACK(MOBILE *mobile, char cmd, char seq)
+//	Description: queues an acknowledge frame, which is written together with
+//	the next request (see _sendFrame()) or by _txFlush()
+//	Parameters:
+//		mobile		connected phone
+//		cmd			command (4th byte) of frame being acknowledged
+//		seq			sequence number (third-to-last byte) of frame being acknowledged
+//	Note: It is assumed that the phone has already been opened by openMobile().
+
+void _sendACK(MOBILE *mobile, char cmd, char seq)
+{
+	TXSTATE *tx = &mobile->tx;
+	char *pAck;
+	unsigned short chk;
+
+	if (tx->len + ACK_SIZE > TXBUF_SIZE)
+		_txFlush(mobile);		// BUG: lots of frames without a request in between
+	pAck = tx->buf + tx->len;
+
+	pAck[FBUS_FRAMEID] = FBUS_CABLE;
+	pAck[FBUS_DEST] = FBUS_PHONE;
+	pAck[FBUS_SRC] = FBUS_TERMINAL;
+	pAck[FBUS_CMD] = FBUS_ACK;
+	pAck[FBUS_LENMSB] = 0x00;
+	pAck[FBUS_LENLSB] = 0x02;
+	pAck[6]	= cmd;
+	pAck[7]	= seq & 0x7;	// sequence number (lower three bytes of origianl frame)
+	chk = _checksum(pAck, 8);
+	pAck[8] = (char)(chk & 0xff);	// checksum (xor of even bytes)
+	pAck[9] = (char)(chk >> 8);		// checksum (xor of odd bytes)
+
+	tx->len += ACK_SIZE;
+	COUNT(mobile->stats.acksSent, 1);
+}
+
+
+//	bool _txFlush(MOBILE *mobile)
+//	Description: writes the ACKs queued by _sendACK(), if any
+//	Parameters:
+//		mobile		connected phone
+//	Return Value: true if the queue was empty or all bytes have been written
+//	Notes: This is called whenever no request follows right away: before
+//	waiting for input and when a scan has ended.
+
+bool _txFlush(MOBILE *mobile)
+{
+	TXSTATE *tx = &mobile->tx;
+	bool ret;
+
+	if (!tx->len)
+		return true;
+	ret = _writePort(mobile, tx->buf, tx->len);
+	tx->len = 0;
+	COUNT(mobile->stats.writes, 1);
+	return ret;
+}
+
+
+//	void _rxReset(RXSTATE *rx)
+//	Description: empties the receive buffer and restarts the frame parser
+//	Parameters:
+//		rx			receive state of a COM port
+
+void _rxReset(RXSTATE *rx)
+{
+	rx->head = 0;
+	rx->tail = 0;
+	rx->state = RX_FRAMEID;
+	rx->acked = 0;
+	rx->frames = 0;
+	rx->badChecksums = 0;
+	rx->discarded = 0;
+}
+
+
+//	bool _rxParse(RXSTATE *rx, unsigned char c)
+//	Description: feeds one byte into the frame parser of a COM port. Header,
+//	length, payload and checksums are tracked in rx, so a frame may arrive
+//	in any number of reads.
+//	Parameters:
+//		rx			receive state of a COM port
+//		c			next byte read from the wire
+//	Return Value: true if c completed a frame with valid checksums. Its command
+//	is in rx->cmd, the frame in rx->frame with the payload (including the
+//	sequence number) starting at FRAME_HEADER and rx->length bytes long.
+//	Notes: On a header mismatch or a wrong checksum the parser resynchronizes
+//	on the following bytes, bytes are never looked at twice. A frame starting
+//	inside a corrupted one is lost then, the phone resends it as we didn't
+//	acknowledge it. _rxPoll() copies payloads in bulk instead of calling this.
+//	Frames and dropped bytes are counted in rx (see STATS).
+
+bool _rxParse(RXSTATE *rx, unsigned char c)
+{
+	RXSTATES prev = rx->state;
+
+	switch (rx->state)
+	{
+	case RX_FRAMEID:
+		if (c == FBUS_CABLE)
+		{
+			rx->frame[FBUS_FRAMEID] = c;
+			rx->pos = 1;
+			rx->state = RX_DEST;
+		}
+		else
+			COUNT(rx->discarded, 1);		// garbage between frames
+		return false;
+	case RX_DEST:
+		rx->state = (c == FBUS_TERMINAL) ? RX_SRC : RX_FRAMEID;	// destination: terminal
+		break;
+	case RX_SRC:
+		rx->state = (c == FBUS_PHONE) ? RX_CMD : RX_FRAMEID;	// sender: phone
+		break;
+	case RX_CMD:
+		rx->cmd = c;
+		rx->state = RX_LENMSB;
+		break;
+	case RX_LENMSB:
+		rx->state = (c == 0x00) ? RX_LENLSB : RX_FRAMEID;	// we never see frames > 255 bytes
+		break;
+	case RX_LENLSB:
+		rx->length = c;
+		rx->end = _frameChecksums(c);		// padding byte after an odd payload length
+		rx->state = (c != 0) ? RX_PAYLOAD : RX_FRAMEID;	// there is at least a sequence number
+		break;
+	case RX_PAYLOAD:
+		rx->frame[rx->pos++] = c;
+		if (rx->pos == rx->end)
+		{
+			rx->sum = _checksum(rx->frame, rx->end);
+			rx->state = RX_CHKEVEN;
+		}
+		return false;
+	case RX_CHKEVEN:
+		rx->state = (c == (rx->sum & 0xff)) ? RX_CHKODD : RX_FRAMEID;
+		break;
+	case RX_CHKODD:
+		rx->state = RX_FRAMEID;
+		if (c == (rx->sum >> 8))
+		{
+			COUNT(rx->frames, 1);
+			return true;
+		}
+		break;
+	}
+
+	if (rx->state == RX_FRAMEID)
+	{
+		// the frame so far is dropped (with the checksum of even bytes, if it was right)
+		if (prev >= RX_CHKEVEN)
+			COUNT(rx->badChecksums, 1);
+		COUNT(rx->discarded, rx->pos + (prev == RX_CHKODD));
+
+		// a mismatching byte might be the start of the next frame
+		if (c == FBUS_CABLE)
+		{
+			rx->frame[FBUS_FRAMEID] = c;
+			rx->pos = 1;
+			rx->state = RX_DEST;
+		}
+		else
+			COUNT(rx->discarded, 1);
+	}
+	else if (rx->state <= RX_PAYLOAD)
+		rx->frame[rx->pos++] = c;		// header byte
+
+	return false;
+}
+
+
+//	unsigned long _rxWrite(RXSTATE *rx, const char *buf, unsigned long len)
+//	Description: appends bytes to a receive ring buffer without reading them
+//	from a port (used for recorded streams)
+//	Parameters:
+//		rx			receive state
+//		buf			bytes to append
+//		len			number of bytes
+//	Return Value: number of bytes appended (limited by the free space)
+
+unsigned long _rxWrite(RXSTATE *rx, const char *buf, unsigned long len)
+{
+	unsigned long i, lFree = RXBUF_SIZE - (rx->head - rx->tail);
+
+	if (len > lFree)
+		len = lFree;
+	for (i=0; i<len; i++)
+		rx->ring[rx->head++ & (RXBUF_SIZE-1)] = buf[i];
+	return len;
+}
+
+
+//	bool _rxPoll(RXSTATE *rx)
+//	Description: parses the bytes in a receive ring buffer until a frame is complete
+//	Parameters:
+//		rx			receive state
+//	Return Value: true if a valid frame (ACKs included) has been found, see
+//	_rxParse(). Bytes following it stay in the ring buffer.
+
+bool _rxPoll(RXSTATE *rx)
+{
+	unsigned long n, lContiguous;
+
+	while (rx->tail != rx->head)
+	{
+		if (rx->state == RX_PAYLOAD)
+		{
+			// copy as much of the payload as is buffered in one go
+			n = rx->end - rx->pos;
+			if (n > rx->head - rx->tail)
+				n = rx->head - rx->tail;
+			lContiguous = RXBUF_SIZE - (rx->tail & (RXBUF_SIZE-1));
+			if (n > lContiguous)
+				n = lContiguous;
+			memcpy(rx->frame + rx->pos, rx->ring + (rx->tail & (RXBUF_SIZE-1)), n);
+			rx->pos += n;
+			rx->tail += n;
+			if (rx->pos == rx->end)
+			{
+				// verify the whole frame at once
+				rx->sum = _checksum(rx->frame, rx->end);
+				rx->state = RX_CHKEVEN;
+			}
+			continue;
+		}
+
+		if (_rxParse(rx, rx->ring[rx->tail++ & (RXBUF_SIZE-1)]))
+			return true;
+	}
+	return false;
+}
+
+
+//	unsigned long _rxRead(MOBILE *mobile, unsigned long lAvail)
+//	Description: reads bytes from the port of a phone into its receive ring
+//	buffer without waiting for them
+//	Parameters:
+//		mobile		connected phone
+//		lAvail		maximum number of bytes to read (limited to the free space)
+//	Return Value: number of bytes read
+
+unsigned long _rxRead(MOBILE *mobile, unsigned long lAvail)
+{
+	RXSTATE *rx = &mobile->rx;
+	unsigned long lFree, lRead, lTotal = 0;
+
+	// read into the free space of the ring buffer, in at most two chunks
+	lFree = RXBUF_SIZE - (rx->head - rx->tail);
+	if (lAvail > lFree)
+		lAvail = lFree;
+	while (lAvail)
+	{
+		lFree = RXBUF_SIZE - (rx->head & (RXBUF_SIZE-1));	// up to the end of the array
+		lRead = _readPort(mobile, (char*)rx->ring + (rx->head & (RXBUF_SIZE-1)), (lAvail < lFree) ? lAvail : lFree);
+		if (lRead == 0)
+			break;
+		rx->head += lRead;
+		lAvail -= lRead;
+		lTotal += lRead;
+	}
+
+	if (mobile->traceByte && lTotal)
+	{
+		mobile->traceByte = false;
+		if (mobile->traceProc)
+			mobile->traceProc(mobile, TRACE_FIRSTBYTE, lTotal, mobile->traceUser);
+	}
+	return lTotal;
+}
+
+
+//	bool _rxFill(MOBILE *mobile, DWORD dwDeadline)
+//	Description: waits for input and reads it into the receive ring buffer of a
+//	COM port
+//	Parameters:
+//		mobile		connected phone
+//		dwDeadline	point in time (as returned by _getTicks()) to give up
+//	Return Value: true if bytes have been read, false if a timeout occured
+
+bool _rxFill(MOBILE *mobile, DWORD dwDeadline)
+{
+	unsigned long lAvail;
+
+	// nothing will be sent while waiting, so ACKs go out now
+	_txFlush(mobile);
+
+	lAvail = _waitInput(mobile, dwDeadline);
+	if (lAvail == 0)
+		return false;
+
+	_rxRead(mobile, lAvail);
+	return true;
+}
+
+
+//	const char* _nextFrame(MOBILE *mobile, char cmd)
+//	Description: parses the bytes in the receive buffer of a phone up to the
+//	first frame of a given type and returns its payload. All valid frames are
+//	being acknowledged, no matter if they match the specified type, ACKs of the
+//	phone are noted in the receive state. Invalid frames are being ignored.
+//	Parameters:
+//		mobile		connected phone
+//		cmd			command (4th byte) of the desired frame
+//	Return Value: payload of the frame, NULL if the buffer holds no such frame
+//	Notes: The payload lives in the receive buffer of the phone and stays valid
+//	until the next call for the same phone. It is mobile->rx.length-1 bytes long
+//	without the sequence number, which follows, and contains 0x00 bytes (e.g.
+//	at the end of each line of a Netmonitor page). Bytes following the frame
+//	are kept for that call.
+
+const char* _nextFrame(MOBILE *mobile, char cmd)
+{
+	RXSTATE *rx = &mobile->rx;
+	char *pPayload = rx->frame + FRAME_HEADER;
+
+	while (_rxPoll(rx))
+	{
+		if (mobile->traceProc)
+			mobile->traceProc(mobile, TRACE_FRAME, rx->cmd, mobile->traceUser);
+
+		if (rx->cmd == FBUS_ACK)
+		{
+			// ACKs are neither acknowledged nor returned, just noted
+			if (rx->length >= 2)
+				rx->acked |= 1 << (pPayload[1] & 0x07);
+			continue;
+		}
+
+		// valid frame, send ACK
+		_sendACK(mobile, rx->cmd, pPayload[rx->length-1]);
+
+		// check if requested frame
+		if (rx->cmd == (unsigned char)cmd)
+			return pPayload;
+	}
+
+	return NULL;
+}
+
+
+//	DWORD _requestDeadline(MOBILE *mobile)
+//	Description: calculates until when the reply to a request sent now is waited
+//	for: the fixed or adaptive timeout of the phone (see setMobileTimeouts()),
+//	but not past the end of the scan's budget
+//	Return Value: point in time (as returned by _getTicks())
+
+DWORD _requestDeadline(MOBILE *mobile)
+{
+	SESSION *session = &mobile->session;
+	DWORD dwDeadline = _getTicks() + (session->dwTimeout ? session->dwTimeout : session->dwRTO);
+
+	if (session->dwBudget && (long)(dwDeadline - session->dwScanDeadline) > 0)
+		dwDeadline = session->dwScanDeadline;
+	return dwDeadline;
+}
+
+
+//	void _sampleRTT(MOBILE *mobile, DWORD dwSent)
+//	Description: updates the round trip time of a phone with a reply received
+//	now and derives the adaptive timeout from it, like TCP does (RFC 6298):
+//	the smoothed round trip time plus four times its mean deviation
+//	Parameters:
+//		mobile		connected phone
+//		dwSent		point in time the request has been sent (see _getTicks())
+
+void _sampleRTT(MOBILE *mobile, DWORD dwSent)
+{
+	SESSION *session = &mobile->session;
+	DWORD dwSample = _getTicks() - dwSent, dwRTO;
+	float fSample = (float)dwSample, fDelta;
+	unsigned int bucket;
+
+	// histogram by powers of two
+	for (bucket=0; bucket<STATS_RTT-1 && (dwSample >> (bucket+1)); bucket++)
+		;
+	COUNT(mobile->stats.rtt[bucket], 1);
+
+	if (fSample < 1.0f)
+		fSample = 1.0f;		// below the resolution of _getTicks()
+	if (session->fRTT == 0.0f)
+	{
+		session->fRTT = fSample;
+		session->fRTTVar = fSample / 2.0f;
+	}
+	else
+	{
+		fDelta = fSample - session->fRTT;
+		session->fRTT += fDelta / 8.0f;
+		session->fRTTVar += ((fDelta < 0.0f ? -fDelta : fDelta) - session->fRTTVar) / 4.0f;
+	}
+
+	dwRTO = (DWORD)(session->fRTT + 4.0f*session->fRTTVar + 0.5f);
+	if (dwRTO < TIMEOUT_MIN)
+		dwRTO = TIMEOUT_MIN;
+	if (dwRTO > TIMEOUT)
+		dwRTO = TIMEOUT;
+	session->dwRTO = dwRTO;
+}
+
+
+//	void _timedOut(MOBILE *mobile)
+//	Description: notes a request given up, which doubles the adaptive timeout
+//	(up to TIMEOUT) unless it was the scan's budget which ran out
+
+void _timedOut(MOBILE *mobile)
+{
+	SESSION *session = &mobile->session;
+
+	session->timeouts++;
+	if (session->dwBudget && (long)(_getTicks() - session->dwScanDeadline) >= 0)
+		return;
+	session->dwRTO = (session->dwRTO*2 < TIMEOUT) ? session->dwRTO*2 : TIMEOUT;
+}
+
+
+//	void _countTimeout(MOBILE *mobile, const char *args)
+//	Description: counts a request given up in the statistics of a phone
+//	Parameters:
+//		mobile		connected phone
+//		args		arguments of the request (0x64 0x01 or 0x7e <page>)
+
+void _countTimeout(MOBILE *mobile, const char *args)
+{
+	unsigned int i = _requestIndex(args);
+
+	if (i < STATS_REQUESTS)
+		COUNT(mobile->stats.timeouts[i], 1);
+}
+
+
+//	void _countScan(MOBILE *mobile, ERRORS err)
+//	Description: counts a scan which talked to the phone in its statistics
+//	Parameters:
+//		mobile		connected phone
+//		err			result of the scan (see getMobilePages())
+
+void _countScan(MOBILE *mobile, ERRORS err)
+{
+	COUNT(mobile->stats.scans, 1);
+	if (err == E_PARTIAL)
+		COUNT(mobile->stats.partial, 1);
+	else if (err != SUCCESS)
+		COUNT(mobile->stats.failed, 1);
+}
+
+
+//	const char* _receiveFrame(MOBILE *mobile, char cmd)
+//	Description: waits for the first frame of a given type and returns its
+//	payload (see _nextFrame()). If there is no matching frame before the
+//	deadline of the request (see _requestDeadline()), this function returns.
+//	Parameters:
+//		mobile		connected phone
+//		cmd			command (4th byte) of the desired frame
+//	Return Value: payload of the frame (without sequence number stored in last
+//	byte), NULL if a timeout occured
+//	Notes: It is assumed that the phone has already been opened by openMobile().
+//	The returned payload stays valid until the next call for the same phone.
+//	No memory is being allocated.
+
+const char* _receiveFrame(MOBILE *mobile, char cmd)
+{
+	DWORD dwDeadline = _requestDeadline(mobile);	// point in time we give up
+	const char *result;
+
+	do
+	{
+		// parse everything in the ring buffer
+		result = _nextFrame(mobile, cmd);
+		if (result)
+			return result;
+
+		// wait for data in input buffer (or timeout occurs)
+		if (!_rxFill(mobile, dwDeadline))
+		{
+			_timedOut(mobile);
+			return NULL;
+		}
+	}
+	while (true);
+}
+
+
+//	unsigned int _requestIndex(const char *args)
+//	Description: numbers the requests which are sent by this library
+//	Parameters:
+//		args		arguments of the request (0x64 0x01 or 0x7e <page>)
+//	Return Value: 0 for the security command, 1 to 3 for pages 3, 4 and 5, 4
+//	for page 0x0b, STATS_REQUESTS or above for anything else (see STATS.timeouts)
+
+unsigned int _requestIndex(const char *args)
+{
+	if (args[0] != 0x7e)
+		return (args[0] == 0x64 && args[1] == 0x01) ? 0 : STATS_REQUESTS;	// security command
+	else if (args[1] == 0x0b)
+		return 4;
+	else if (args[1] >= 3 && args[1] <= 5)
+		return args[1] - 2;		// pages 3, 4 and 5
+	else
+		return STATS_REQUESTS;
+}
+
+
+// frames of the requests numbered by _requestIndex()
+static constexpr REQUESTFRAME requestFrames[STATS_REQUESTS] =
+{
+	_frameTemplate(FBUS_NETMON, "\x64\x01"),	// security command
+	_frameTemplate(FBUS_NETMON, "\x7e\x03"),	// Netmonitor pages
+	_frameTemplate(FBUS_NETMON, "\x7e\x04"),
+	_frameTemplate(FBUS_NETMON, "\x7e\x05"),
+	_frameTemplate(FBUS_NETMON, "\x7e\x0b")
+};
+
+static_assert(requestFrames[0].bytes[FBUS_LENLSB] == 6 && requestFrames[0].bytes[REQUESTFRAME::SEQ] == 0,
+	"security command frame is malformed");
+static_assert((unsigned char)requestFrames[0].bytes[REQUESTFRAME::CHECKSUMS] == (0x1e ^ 0x0c ^ 0x00 ^ 0x00 ^ 0x64 ^ 0x01),
+	"checksum of even bytes is wrong");
+static_assert((unsigned char)requestFrames[0].bytes[REQUESTFRAME::CHECKSUMS+1] == (0x00 ^ 0x40 ^ 0x06 ^ 0x01 ^ 0x01 ^ 0x00),
+	"checksum of odd bytes is wrong");
+
+
+//	int _buildFrame(unsigned int *seqNumber, char cmd, const char* args, int len, char *pTemp)
+//	Description: builds a frame from terminal to the mobile phone. Sequence
+//	number and checksum is being calculated.
+//	Parameters:
+//		seqNumber	sequence number of the phone, advanced by one
+//		cmd			command (4th byte of frame)
+//		args		arguments (9th byte of frame and following), not NULL-terminated
+//		len			length of args in bytes (at most FRAME_MAX-13)
+//		pTemp		destination buffer of FRAME_MAX bytes
+//	Return Value: length of the frame in bytes
+//	Notes: The requests sent by this library are copied from requestFrames,
+//	only other frames are assembled byte by byte.
+
+int _buildFrame(unsigned int *seqNumber, char cmd, const char* args, int len, char *pTemp)
+{
+	unsigned int i, seq, payload, chk;
+
+	// sequence numbers cycle from 40 through 47
+	seq = *seqNumber;
+	*seqNumber = (seq < 0x47) ? seq+1 : 0x40;
+
+	i = _requestIndex(args);
+	if (cmd == FBUS_NETMON && len == 2 && i < STATS_REQUESTS)
+	{
+		// precomputed frame, the sequence number was 0 when its checksums were calculated
+		memcpy(pTemp, requestFrames[i].bytes, REQUESTFRAME::SIZE);
+		pTemp[REQUESTFRAME::SEQ] = (char)seq;
+		pTemp[REQUESTFRAME::CHECKSUMS + (REQUESTFRAME::SEQ & 1)] ^= (char)seq;
+		return REQUESTFRAME::SIZE;
+	}
+
+	payload = len + 4;
+	pTemp[FBUS_FRAMEID] = FBUS_CABLE;
+	pTemp[FBUS_DEST] = FBUS_PHONE;
+	pTemp[FBUS_SRC] = FBUS_TERMINAL;
+	pTemp[FBUS_CMD] = cmd;
+	pTemp[FBUS_LENMSB] = 0x00;
+	pTemp[FBUS_LENLSB] = (char)payload;
+	pTemp[FBUS_PAYLOAD] = 0x00;		// first bytes of payload (seem to be static)
+	pTemp[FBUS_PAYLOAD+1] = 0x01;
+	memcpy(pTemp+FBUS_PAYLOAD+2, args, len);	// arguments, 0x00 included
+	pTemp[FBUS_PAYLOAD+2+len] = 0x01;			// also static?
+	pTemp[FBUS_PAYLOAD+payload-1] = (char)seq;	// sequence number (last byte of payload)
+	pTemp[FBUS_PAYLOAD+payload] = 0x00;			// padding byte after an odd payload length
+
+	// calculate checksum
+	i = _frameChecksums(payload);
+	chk = _checksum(pTemp, i);
+	pTemp[i] = (char)(chk & 0xff);		// XOR of all even bytes
+	pTemp[i+1] = (char)(chk >> 8);		// XOR of all odd bytes
+
+	return i+2;
+}
+
+
+//	unsigned char _sendFrame(MOBILE *mobile, char cmd, const char* args, int len)
+//	Description: sends a frame from terminal to the mobile phone. Sequence
+//	number and checksum is being calculated.
+//	Parameters:
+//		mobile		connected phone
+//		cmd			command (4th byte of frame)
+//		args		arguments (9th byte of frame and following), not NULL-terminated
+//		len			length of args in bytes
+//	Return Value: sequence number of the frame
+//	Notes: It is assumed that the phone has already been opened by openMobile().
+//	The frame is built behind the ACKs queued by _sendACK() and written in
+//	the same call.
+
+unsigned char _sendFrame(MOBILE *mobile, char cmd, const char* args, int len)
+{
+	TXSTATE *tx = &mobile->tx;
+	char *pFrame;
+	int length;
+	unsigned char seq;
+
+	if (tx->len > TXBUF_SIZE - FRAME_MAX)
+		_txFlush(mobile);
+	pFrame = tx->buf + tx->len;
+	length = _buildFrame(&mobile->seqNumber, cmd, args, len, pFrame);
+	seq = (unsigned char)pFrame[FBUS_PAYLOAD + (unsigned char)pFrame[FBUS_LENLSB] - 1];	// last byte of payload
+
+	// forget earlier ACKs for this sequence number
+	mobile->rx.acked &= ~(1 << (seq & 0x07));
+
+	// send over the wire, together with the queued ACKs
+	tx->len += length;
+	_txFlush(mobile);
+	COUNT(mobile->stats.framesSent, 1);
+	if (mobile->traceProc)
+	{
+		mobile->traceProc(mobile, TRACE_REQUEST, (unsigned char)((args[0] == 0x7e) ? args[1] : args[0]), mobile->traceUser);
+		mobile->traceByte = true;
+	}
+
+	return seq;
+}
+
+
+//	bool _isPage(const char *result, char page)
+//	Description: checks whether a frame returned by _receiveFrame() is the
+//	requested Netmonitor page (0x01 0x7e <page> in its header)
+//	Parameters:
+//		result		frame as returned by _receiveFrame()
+//		page		page number
+//	Return Value: true if it is, false for error replies or replies to other requests
+
+bool _isPage(const char *result, char page)
+{
+	return (result[0] && result[1] == 0x7e && result[2] == page);
+}
+
+
+//	ERRORS _requestAccess(MOBILE *mobile)
+//	Description: sends the security command, which is necessary for reading
+//	Netmonitor values, unless the session of the COM port already has access
+//	Parameters:
+//		mobile		connected phone
+//	Return Value: SUCCESS (0) or E_NODATA if the security command was not answered
+//	Notes: Access is revoked by _requestPage() and _requestPages() on timeouts and
+//	error replies, and on connecting and disconnecting.
+
+ERRORS _requestAccess(MOBILE *mobile)
+{
+	if (mobile->session.access)
+		return SUCCESS;
+
+	DWORD dwSent = _getTicks();
+
+	_sendFrame(mobile, 0x40, "\x64\x01", 2);
+	if (!_receiveFrame(mobile, 0x40))		// wait for any return
+	{
+		_countTimeout(mobile, "\x64\x01");
+		return E_NODATA;		// error: nothing in input buffer, device not connected?
+	}
+
+	_sampleRTT(mobile, dwSent);
+	mobile->session.access = true;
+	return SUCCESS;
+}
+
+
+//	const char* _requestPage(MOBILE *mobile, char page)
+//	Description: requests a single Netmonitor page. If the phone answers with
+//	something else, access is requested again and the page once more.
+//	Parameters:
+//		mobile		connected phone
+//		page		page number
+//	Return Value: page as returned by _receiveFrame() or NULL on timeouts and
+//	error replies
+//	Notes: _requestAccess() should have been called before.
+
+const char* _requestPage(MOBILE *mobile, char page)
+{
+	const char *result;
+	char cTeststring[] = { 0x7e, page };	// arguments for netmonitor tests
+	DWORD dwSent;
+	int retry;
+
+	for (retry=0; retry<2; retry++)
+	{
+		dwSent = _getTicks();
+		_sendFrame(mobile, 0x40, cTeststring, 2);
+		result = _receiveFrame(mobile, 0x40);
+		if (!result)
+		{
+			_countTimeout(mobile, cTeststring);
+			break;			// timeout occured
+		}
+		_sampleRTT(mobile, dwSent);
+		if (_isPage(result, page))
+			return result;
+
+		// error reply, phone might have left Netmonitor mode
+		mobile->session.access = false;
+		if (_requestAccess(mobile) != SUCCESS)
+			return NULL;
+	}
+
+	mobile->session.access = false;
+	return NULL;
+}
+
+
+//	int _matchReply(const char *result, const REQUEST *req, unsigned int num, unsigned char acked)
+//	Description: finds the request a reply belongs to. Replies naming a page
+//	(0x7e <page> in their header) or the security command (0x64) are matched to
+//	that request, others to the oldest open request whose sequence number has
+//	been acknowledged by the phone (or the oldest open one, if none was).
+//	Parameters:
+//		result		frame as returned by _receiveFrame()
+//		req			requests sent, in order
+//		num			number of entries in req
+//		acked		acknowledged sequence numbers (see RXSTATE)
+//	Return Value: index into req, -1 if no request is open or the reply is a
+//	late one to a request of an earlier query
+
+int _matchReply(const char *result, const REQUEST *req, unsigned int num, unsigned char acked)
+{
+	unsigned int i;
+
+	// match by header (0x01 0x64 for the security command, 0x01 0x7e <page> for pages)
+	for (i=0; i<num; i++)
+	{
+		if (req[i].open && result[1] == req[i].args[0] && (req[i].args[0] != 0x7e || result[2] == req[i].args[1]))
+			return i;
+	}
+	// pages or security replies nobody waits for would shift all following replies
+	if (result[1] == 0x7e || result[1] == 0x64)
+		return -1;
+	// otherwise (error replies) the oldest open (and acknowledged) request
+	for (i=0; i<num; i++)
+	{
+		if (req[i].open && (acked & (1 << (req[i].seq & 0x07))))
+			return i;
+	}
+	for (i=0; i<num; i++)
+	{
+		if (req[i].open)
+			return i;
+	}
+	return -1;
+}
+
+
+//	ERRORS _requestPages(MOBILE *mobile, const char *pages, unsigned int numPages, PAGES *dest)
+//	Description: sends the security command (unless the session already has
+//	access) and requests for a number of Netmonitor pages back to back, then
+//	decodes the replies as they arrive (see _matchReply()).
+//	Parameters:
+//		mobile		connected phone
+//		pages		page numbers (3, 4, 5 or 0x0b)
+//		numPages	number of entries in pages (at most 7, so sequence numbers stay unique)
+//		dest		pointer to a PAGES struct being filled (see _decodePage())
+//	Return Value: SUCCESS (0) or E_NODATA if no request was answered at all
+//	Notes: The scan ends when the last reply arrived or a reply took longer than
+//	the timeout (see _requestDeadline()). Access is revoked if a page is missing or answered by an error reply.
+
+ERRORS _requestPages(MOBILE *mobile, const char *pages, unsigned int numPages, PAGES *dest)
+{
+	const char *result;
+	REQUEST req[8];
+	bool received[8];
+	unsigned int i, first = 0, num = 0, numOpen;
+	int match;
+
+	// send everything at once
+	if (!mobile->session.access)
+	{
+		req[num].args[0] = 0x64;	// necessary for reading netmonitor values
+		req[num].args[1] = 0x01;
+		num++;
+		first = 1;
+	}
+	for (i=0; i<numPages; i++)
+	{
+		req[num].args[0] = 0x7e;	// netmonitor test
+		req[num].args[1] = pages[i];
+		num++;
+		received[i] = false;
+	}
+	for (i=0; i<num; i++)
+	{
+		req[i].dwSent = _getTicks();
+		req[i].seq = _sendFrame(mobile, 0x40, req[i].args, 2);
+		req[i].open = true;
+	}
+
+	numOpen = num;
+	while (numOpen)
+	{
+		result = _receiveFrame(mobile, 0x40);
+		if (!result)
+			break;		// timeout occured
+
+		match = _matchReply(result, req, num, mobile->rx.acked);
+		if (match < 0)
+			continue;	// late reply of an earlier query
+		req[match].open = false;
+		numOpen--;
+		_sampleRTT(mobile, req[match].dwSent);
+
+		if ((unsigned int)match < first)
+			mobile->session.access = true;
+		else if (_isPage(result, req[match].args[1]))
+		{
+			_decodePage(mobile, result, mobile->rx.length-1, dest);
+			received[match-first] = true;
+		}
+	}
+
+	// ask for access again on the next query if something went wrong
+	for (i=0; i<numPages; i++)
+	{
+		if (!received[i])
+			mobile->session.access = false;
+	}
+	for (i=0; i<num; i++)
+	{
+		if (req[i].open)
+			_countTimeout(mobile, req[i].args);
+	}
+	_txFlush(mobile);		// ACK of the last reply
+
+	if (numOpen == num)
+		return E_NODATA;		// error: nothing in input buffer, device not connected?
+	return SUCCESS;
+}
+
+
+// a number shown on a Netmonitor page
+typedef struct
+{
+	unsigned char	line;		// zero-based line of the page
+	unsigned char	col;		// first column
+	unsigned char	width;		// characters, numbers are right-aligned
+} PAGEFIELD;
+
+// fields of each line of pages 3, 4 and 5 (e.g. " 70 37-73 37")
+static const PAGEFIELD cellFields[] =
+{
+	{ 0, 0, 3 },		// channel, "xxx" if there is no cell on this line
+	{ 0, 6, 3 }			// signal strength in -dBm, "105" or "-73"
+};
+
+// fields of page 0x0b
+static const PAGEFIELD locFields[] =
+{
+	{ 0, 3, 3 },		// country ("CC:232NC:  5")
+	{ 0, 9, 3 },		// network
+	{ 1, 4, 5 },		// area ("LAC:  120   ")
+	{ 2, 4, 3 },		// channel ("CH: 070     ")
+	{ 3, 0, 5 }			// cell ("12345       ")
+};
+
+// what _parseField() found
+typedef enum
+{
+	FIELD_NUMBER,		// a number
+	FIELD_EMPTY,		// only spaces or "x" (value not available)
+	FIELD_BAD			// anything else
+} FIELDS;
+
+
+//	FIELDS _parseField(const char *page, unsigned int len, const PAGEFIELD *field, unsigned int line, unsigned int *value)
+//	Description: reads a number from a Netmonitor page in place
+//	Parameters:
+//		page		page as returned by _receiveFrame()
+//		len			length of page in bytes
+//		field		column and width of the number
+//		line		line added to the one of field
+//		value		receives the number (without sign)
+//	Return Value: see FIELDS, FIELD_BAD if the page is too short
+//	Notes: Spaces and a minus sign may precede the digits. The digits are
+//	accumulated without branching on their values.
+
+static FIELDS _parseField(const char *page, unsigned int len, const PAGEFIELD *field, unsigned int line, unsigned int *value)
+{
+	const char *pText;
+	unsigned int i, c, d, digit, v = 0, digits = 0, empty = 0, bad = 0;
+
+	line += field->line;
+	if (PAGE_TEXT + line*PAGE_LINE + PAGE_COLUMNS > len)
+		return FIELD_BAD;		// line missing
+	pText = page + PAGE_TEXT + line*PAGE_LINE + field->col;
+
+	for (i=0; i<field->width; i++)
+	{
+		c = (unsigned char)pText[i];
+		d = c - '0';
+		digit = (d <= 9);
+		v = v*(1 + 9*digit) + d*digit;
+		bad |= (1 - digit) & ((digits != 0) | ((c != ' ') & (c != '-')));	// only padding before the digits
+		empty += (c == ' ') | (c == 'x');
+		digits += digit;
+	}
+
+	*value = v;
+	if (empty == field->width)
+		return FIELD_EMPTY;
+	return (digits && !bad) ? FIELD_NUMBER : FIELD_BAD;
+}
+
+
+//	unsigned int _decodeCells(const char *page, unsigned int len, CELL *dest, unsigned int size, unsigned int *malformed)
+//	Description: decodes the neighbour cells on Netmonitor page 3, 4 or 5
+//	Parameters:
+//		page		page as returned by _receiveFrame()
+//		len			length of page in bytes
+//		dest		array being filled
+//		size		number of entries available in dest
+//		malformed	receives the number of lines which could not be decoded
+//	Return Value: number of entries filled (0 if the page showed no cells)
+//	Notes: Channel 0 is skipped like an empty line, as atoi() did before.
+
+unsigned int _decodeCells(const char *page, unsigned int len, CELL *dest, unsigned int size, unsigned int *malformed)
+{
+	unsigned int line, channel, p, num = 0;
+	FIELDS f;
+
+	*malformed = 0;
+	for (line=0; line<PAGE_CELLS && num<size; line++)
+	{
+		f = _parseField(page, len, &cellFields[0], line, &channel);
+		if (f == FIELD_EMPTY || (f == FIELD_NUMBER && !channel))
+			continue;		// no cell on this line
+		if (f == FIELD_BAD || _parseField(page, len, &cellFields[1], line, &p) != FIELD_NUMBER)
+		{
+			(*malformed)++;
+			continue;
+		}
+		dest[num].channel = (unsigned short)channel;
+		dest[num].p = p;
+		num++;
+	}
+
+	return num;
+}
+
+
+//	ERRORS _decodeLocation(const char *page, unsigned int len, LOC *dest, unsigned int *malformed)
+//	Description: decodes Netmonitor page 0x0b into a LOC struct
+//	Parameters:
+//		page		page as returned by _receiveFrame()
+//		len			length of page in bytes
+//		dest		pointer to a LOC struct being filled
+//		malformed	receives the number of lines which could not be decoded
+//	Return Value: SUCCESS (0) or E_NODATA if a field could not be decoded, dest
+//	is left alone then
+//	Notes: Empty fields (no service) are 0, as atoi() returned before.
+
+ERRORS _decodeLocation(const char *page, unsigned int len, LOC *dest, unsigned int *malformed)
+{
+	unsigned int values[sizeof(locFields)/sizeof(locFields[0])];
+	unsigned int i, badLines = 0;
+	FIELDS f;
+
+	for (i=0; i<sizeof(locFields)/sizeof(locFields[0]); i++)
+	{
+		f = _parseField(page, len, &locFields[i], 0, &values[i]);		// 0 if empty
+		if (f == FIELD_BAD)
+			badLines |= 1 << locFields[i].line;
+	}
+
+	*malformed = 0;
+	for (; badLines; badLines >>= 1)
+		*malformed += badLines & 1;
+	if (*malformed)
+		return E_NODATA;
+
+	dest->country = values[0];
+	dest->network = values[1];
+	dest->area = (unsigned short)values[2];
+	dest->channel = (unsigned short)values[3];
+	dest->cell = (unsigned short)values[4];
+
+	return SUCCESS;
+}
+
+
+//	void _decodePage(MOBILE *mobile, const char *page, unsigned int len, PAGES *dest)
+//	Description: decodes Netmonitor page 3, 4, 5 or 0x0b into a PAGES struct
+//	Parameters:
+//		mobile		connected phone, malformed lines are counted in its STATS
+//		page		page as returned by _receiveFrame() (see _isPage())
+//		len			length of page in bytes
+//		dest		pointer to a PAGES struct being filled
+//	Return Value: none
+//	Notes: A page 0x0b which cannot be decoded counts as not received.
+
+void _decodePage(MOBILE *mobile, const char *page, unsigned int len, PAGES *dest)
+{
+	unsigned int i, flag, malformed;
+
+	if (page[2] == 0x0b)
+	{
+		flag = PAGE_0B;
+		if (_decodeLocation(page, len, &dest->loc, &malformed) == SUCCESS)
+			dest->received |= flag;
+	}
+	else
+	{
+		i = page[2] - 3;	// pages 3, 4 and 5
+		flag = PAGE_3 << i;
+		dest->num[i] = _decodeCells(page, len, dest->cells[i], PAGE_CELLS, &malformed);
+		dest->received |= flag;
+	}
+
+	if (malformed)
+	{
+		dest->malformed |= flag;
+		COUNT(mobile->stats.malformedLines, malformed);
+	}
+}
 
 
-//	Internal Functions
+//	Exported Functions
 
 
-//	void _sendACK(unsigned int comPort, char cmd, char seq)
-//	Description: sends an acknowledge frame
+//	ERRORS openMobile(const char *device, MOBILE **dest)
+//	Description: opens a serial device connected to an FBUS enabled mobile and
+//	sends the initialization string
 //	Parameters:
-//		cmdPort		number of COM port
-//		cmd			command (4th byte) of frame being acknowledged
-//		seq			sequence number (third-to-last byte) of frame being acknowledged
-//	Note: It is assumed that the COM port has already been opened by connectMobile().
+//		device		name of the serial device (e.g. \\.\COM1 or /dev/ttyUSB0)
+//		dest		receives the handle of the phone
+//	Return Value: SUCCESS (0) or an error code as specified in ERROR (libNokiaNetmon.h)
+//	Notes: The handle has to be freed by closeMobile().
 
-void _sendACK(unsigned int comPort, char cmd, char seq)
+ERRORS openMobile(const char *device, MOBILE **dest)
 {
-	char cAck[] = { 0x1e, 0x00, 0x0c, 0x7f, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00 };
-	DWORD dwBytesWritten;	// unused
+	MOBILE *mobile;
+	ERRORS err;
+	char init_char[128];		// characters used for device initialization
+	unsigned int i;
+
+	mobile = (MOBILE*)malloc(sizeof(MOBILE));
+	if (!mobile)
+		return E_CANTOPENPORT;
+
+	err = _openPort(device, &mobile->handle);
+	if (err != SUCCESS)
+	{
+		free(mobile);
+		return err;
+	}
 
-	cAck[6]	= cmd;
-	cAck[7]	= seq & 0x7;	// sequence number (lower three bytes of origianl frame)
-	cAck[8] = cAck[0] ^ cAck[2] ^ cAck[4] ^ cAck[6];	// checksum (xor of odd/even bytes)
-	cAck[9] = cAck[1] ^ cAck[3] ^ cAck[5] ^ cAck[7];	// checksum (xor of odd/even bytes)
+	mobile->seqNumber = 0x40;		// sequence numbers start at 0x40
+	_rxReset(&mobile->rx);
+	mobile->tx.len = 0;
+	mobile->session.access = false;	// security command is sent with the first query
+	mobile->session.pipelining = false;
+	mobile->session.pages = PAGES_ALL;
+	mobile->session.dwTimeout = TIMEOUT;
+	mobile->session.dwBudget = 0;
+	mobile->session.fRTT = 0.0f;
+	mobile->session.fRTTVar = 0.0f;
+	mobile->session.dwRTO = TIMEOUT;		// until the first reply has been timed
+	mobile->session.timeouts = 0;
+	memset(&mobile->stats, 0, sizeof(mobile->stats));
+	mobile->dwOpened = _getTicks();
+	mobile->traceProc = NULL;
+	mobile->traceUser = NULL;
+	mobile->traceByte = false;
 
-	WriteFile(comHandles[comPort-1], &cAck, 10, &dwBytesWritten, NULL);
+	// send init string (128 times 0x55 to synch with the UART)
+	// one source recommends sleeping for 10 miliseconds between bytes, but seems to work fine
+	for (i=0; i<sizeof(init_char); i++)
+		init_char[i] = 0x55;
+	if (!_writePort(mobile, init_char, sizeof(init_char)))
+	{
+		closeMobile(mobile);
+		return E_SENDINITSTRING;
+	}
+
+	*dest = mobile;
+	return SUCCESS;
 }
 
 
-//	char* _receiveFrame(unsigned int comPort, char cmd)
-//	Description: waits for the first frame of a given type and returns its
-//	payload. Checksums of all incoming frames are being validated. All
-//	valid frames are being acknowledged, no matter if they match the specified
-//	type. Invalid frames are being ignored. If there is no matching
-//	frame after TIMEOUT miliseconds, this function returns.
+//	ERRORS openMobilePort(unsigned int comPort, MOBILE **dest)
+//	Description: openMobile() for the serial device of a COM port number
 //	Parameters:
 //		comPort		number of COM port
-//		cmd			command (4th byte) of the desired frame
-//	Return Value: payload of the frame (without sequence number stored in last
-//	byte) as NULL-terminated string (note: has to be free()d by the caller), 
-//	NULL if a timeout occured
-//	Notes: It is assumed that the COM port has already been opened by connectMobile().
-//	This function replaces occuring 0x00 bytes in the input buffer by 0x2e (ASCII .)
-//	characters.
+//		dest		receives the handle of the phone
+//	Return Value: SUCCESS (0) or an error code as specified in ERROR (libNokiaNetmon.h)
+//	Notes: On POSIX systems COM port n is mapped to /dev/ttyS(n-1).
 
-char* _receiveFrame(unsigned int comPort, char cmd)
+ERRORS openMobilePort(unsigned int comPort, MOBILE **dest)
 {
-	char *pBuffer = NULL, *pStart, *pTemp;
-	char cChecksum;
-	COMSTAT comstat;
-	DWORD dwBytesRead;		// unused
-	DWORD dwStartTime = GetTickCount();		// get miliseconds since system start for timeout
-	int length;
-	unsigned long lBufferSize = 0;
+	char cComPort[24];
 
-	do
+	if (comPort < 1)
+		return E_INVALIDPORT;	// error: invalid COM port
+
+#ifdef _WIN32
+	// create (magic) filename (needed for COM ports > 10)
+	sprintf_s(cComPort, sizeof(cComPort), "\\\\.\\COM%u", comPort);
+#else
+	sprintf_s(cComPort, sizeof(cComPort), "/dev/ttyS%u", comPort-1);
+#endif
+
+	return openMobile(cComPort, dest);
+}
+
+
+//	ERRORS getMobileBasestations(MOBILE *mobile, BASE *dest)
+//	Description: writes the channels of all GSM base stations of an FBUS enabled
+//	mobile and its signal levels to the linked list BASE. The order of the entries
+//	is determined by the phone itself, so mostly by signal strength descending
+//	(thus -dBm value increasing).
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		dest		pointer to a BASE struct being filled (overwritten)
+//	Return Value: SUCCESS (0) or E_NODATA if the device seems not connected
+//	Notes: If communication with the device works but the device sees no single base
+//	station, this function returns SUCCESS nontheless, but channel/p[ower] of dest
+//	will be 0. *pNext of the last entry is NULL. The caller must not forget to free all
+//	structs but dest. The security command for Netmonitor access is only sent on the
+//	first query after connecting and after timeouts or error replies.
+
+ERRORS getMobileBasestations(MOBILE *mobile, BASE *dest)
+{
+	CELL cells[MAX_BASESTATIONS];
+	BASE *pCur = dest;
+	unsigned int i, num;
+	ERRORS err;
+
+	// write default values in dest
+	dest->channel = 0;
+	dest->p = 0;
+	dest->pNext = NULL;
+
+	err = getMobileBasestationArray(mobile, cells, MAX_BASESTATIONS, &num);
+	if (err != SUCCESS)
+		return err;
+
+	// build the list
+	for (i=0; i<num; i++)
 	{
-		// wait for data in input buffer (or timeout occurs)
-		do
+		if (i > 0)
 		{
-			Sleep(10);
-			ClearCommError(comHandles[comPort-1], NULL, &comstat);
-
-			// return if timeout occured
-			if (GetTickCount() - dwStartTime > TIMEOUT)
-				return NULL;
+			pCur->pNext = (BASE*)malloc(sizeof(BASE));
+			pCur = pCur->pNext;
 		}
-		while (comstat.cbInQue == 0);
+		pCur->channel = cells[i].channel;
+		pCur->p = cells[i].p;
+	}
+	// set the pNext of the last element to NULL
+	pCur->pNext = NULL;
+
+	return SUCCESS;
+}
 
-		// enlarge buffer
-		pBuffer = (char*)realloc(pBuffer, (size_t)lBufferSize+comstat.cbInQue);
-		ReadFile(comHandles[comPort-1], pBuffer+lBufferSize, comstat.cbInQue, &dwBytesRead, NULL);
-		lBufferSize += comstat.cbInQue;
 
-		// parse buffer
-		pStart = pBuffer;
-		do
-		{
-			// search for frame header
-			while (pStart+3 <= pBuffer+lBufferSize && !(*pStart == 0x1e && *(pStart+1) == 0x0c && *(pStart+2) == 0x00))
-				pStart++;
+//	ERRORS getMobileBasestationArray(MOBILE *mobile, CELL *dest, unsigned int size, unsigned int *num)
+//	Description: writes the channels of all GSM base stations of an FBUS enabled
+//	mobile and its signal levels to an array. The order of the entries is determined
+//	by the phone itself, so mostly by signal strength descending.
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		dest		array being filled
+//		size		number of entries in dest (MAX_BASESTATIONS is always sufficient)
+//		num			receives the number of entries filled
+//	Return Value: SUCCESS (0) or E_NODATA if the device seems not connected
+//	Notes: Cells not fitting into dest are dropped. No memory is allocated.
+
+ERRORS getMobileBasestationArray(MOBILE *mobile, CELL *dest, unsigned int size, unsigned int *num)
+{
+	PAGES pages;
+	unsigned int page, i;
 
-			// check if enough bytes in buffer for minimal packet length
-			if (pStart+9 > pBuffer+lBufferSize)
-				break;
+	ERRORS err;
 
-			// fetch length (we ignore MSB in pStart+4)
-			length = *(pStart+5);
+	*num = 0;
 
-			// check if enough bytes in buffer for specified package length
-			if (pStart+5+length+2 > pBuffer+lBufferSize)	// 5 is leader, 2 is checksum
-				break;
+	err = getMobilePages(mobile, PAGES_CELLS, &pages);
+	if (err != SUCCESS && err != E_PARTIAL)
+		return E_NODATA;		// error: device seems to be gone
 
-			if (*(pStart+3) != 0x7f)
-			{
-				// not an ACK, so we're closer examining the frame
-
-				// checksum even bytes
-				cChecksum = *pStart;
-				for (pTemp = pStart+2; pTemp<pStart+5+length+1; pTemp=pTemp+2)
-					cChecksum ^= *pTemp;
-				if (cChecksum != *pTemp)
-				{
-					// wrong checksum, skip this frame
-					pStart++;
-					continue;
-				}
-				// checksum odd bytes
-				cChecksum = *(pStart+1);
-				for (pTemp = pStart+3; pTemp<pStart+5+length+1; pTemp=pTemp+2)
-					cChecksum ^= *pTemp;
-				if (cChecksum != *pTemp)
-				{
-					pStart++;
-					continue;
-				}
-
-				// valid frame, send ACK
-				_sendACK(comPort, *(pStart+3), *(pStart+5+length));
-
-				// check if requested frame
-				if (*(pStart+3) == cmd)
-				{
-					// convert 0x00 to 0x2e ('.')
-					pTemp = pStart+6;
-					while (pTemp <= pStart+5+length)
-					{
-						if (*pTemp == '\0')
-							*pTemp = '.';		// replacement character
-						pTemp++;
-					}
-
-					// create return variable, free buffer
-					char *result = (char*)malloc(length);	// we skip the sequence number at the end
-					strncpy_s(result, length, pStart+6, length-1);
-					free(pBuffer);
-
-					return result;
-				}
-
-				// not the one we are waiting for
-				// make sure we don't process the same frame twice
-				if (pStart+5+length+2+1 > pBuffer+lBufferSize)
-				{
-					// there is something beyond this frame which we must preserve
-					pStart = pStart+5+length+2+1;	// start of new frame
-					strncpy_s(pBuffer, lBufferSize, pStart, lBufferSize - (pStart - pBuffer));
-					// shrink buffer
-					lBufferSize -= pStart - pBuffer;
-					pBuffer = (char*)realloc(pBuffer, (size_t)lBufferSize);
-					pStart = pBuffer;
-				}
-				else
-				{
-					// nothing beyond this frame, free buffer
-					free(pBuffer);
-					pBuffer = NULL;
-					lBufferSize = 0;
-					break;
-				}
-			}
-			else
-			{
-				// move pStart, so we don't end up checking the same frame twice
-				pStart++;
-			}
-		}
-		while (true);
+	for (page=0; page<3; page++)
+	{
+		if (!(pages.received & (PAGE_3 << page)))
+			continue;	// timeout occured
+		for (i=0; i<pages.num[page] && *num<size; i++)
+			dest[(*num)++] = pages.cells[page][i];
 	}
-	while (true);
+	return SUCCESS;
 }
 
 
-//	void _sendFrame(unsigned int comPort, char cmd, char* args, int len)
-//	Description: sends a frame from terminal to the mobile phone. Sequence
-//	number and checksum is being calculated.
+//	ERRORS getMobileLocation(MOBILE *mobile, LOC *dest)
+//	Description: writes information regarding the currently used GSM network
+//	cell in struct LOC (see libNokiaNetmon.h)
 //	Parameters:
-//		comPort		number of COM port
-//		cmd			command (4th byte of frame)
-//		args		arguments (9th byte of frame and following), not NULL-terminated
-//		len			length of args in bytes
-//	Notes: It is assumed that the COM port has already been opened by connectMobile().
+//		mobile		handle returned by openMobile()
+//		dest		pointer to a LOC struct being filled
+//	Return Value: SUCCESS (0) or E_NODATA if the device seems not connected
 
-void _sendFrame(unsigned int comPort, char cmd, char* args, int len)
+ERRORS getMobileLocation(MOBILE *mobile, LOC *dest)
 {
-	char cChecksum;
-	DWORD dwBytesWritten;	// unused
-	int i, payload;
+	PAGES pages;
 
-	// calculate payload length
-	payload = len + 4;
-	if (payload/2 != (int)payload/2)
-		payload++;		// add padding byte for odd number of bytes
-
-	char *pTemp = (char*)calloc(payload+8, 1);
-	pTemp[0] = 0x1e;	// FBUS frame id (cable)
-	pTemp[1] = 0x00;	// destination (phone)
-	pTemp[2] = 0x0c;	// sender (terminal)
-	pTemp[3] = cmd;		// command
-	pTemp[4] = 0x00;	// MSB of payload length (unused)
-	pTemp[5] = payload;	// payload length
-	pTemp[6] = 0x00;	// first bytes of payload (seem to be static)
-	pTemp[7] = 0x01;
-	strncpy_s(pTemp+8, payload+8, args, len);	// arguments (in payload)
-	pTemp[8+len] = 0x01;			// also static?
-
-	// add padding byte (second-to-last byte of payload), if required
-	if (len+4 < payload)
-		pTemp[5+payload-1] = 0x00;
-
-	// sequence number (last byte of payload)
-	pTemp[5+payload] = seqNumber[comPort-1];
-	if (seqNumber[comPort-1] < 0x47)	// sequence numbers cycle from 40 through 47
-	{
-		seqNumber[comPort-1]++;
-	}
-	else
+	if (getMobilePages(mobile, PAGE_0B, &pages) == E_NODATA)
+		return E_NODATA;
+	if (!(pages.received & PAGE_0B))
+		return E_NODATA;		// error: timeout, phone refused or page too short
+
+	*dest = pages.loc;
+	return SUCCESS;
+}
+
+
+//	ERRORS getMobilePages(MOBILE *mobile, unsigned int pages, PAGES *dest)
+//	Description: requests the Netmonitor pages given by PAGE_* flags, one after
+//	another or pipelined (see setMobilePipelining()), and decodes them
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		pages		PAGE_* flags of the pages to request
+//		dest		pointer to a PAGES struct being filled
+//	Return Value: SUCCESS (0), E_PARTIAL if not all pages have been received
+//	or E_NODATA if no page has been answered
+//	Notes: dest->received tells which pages have been received, dest->malformed
+//	which of them had lines that could not be decoded. A page 0x0b which cannot
+//	be decoded counts as not received. The first timeout ends the
+//	scan, as does the budget set by setMobileTimeouts().
+
+ERRORS getMobilePages(MOBILE *mobile, unsigned int pages, PAGES *dest)
+{
+	static const char cNumbers[] = { 0x03, 0x04, 0x05, 0x0b };
+	char cPages[sizeof(cNumbers)];
+	const char *result;
+	unsigned int i, num = 0;
+	bool answered = false;
+
+	dest->received = 0;
+	dest->partial = false;
+	dest->malformed = 0;
+	for (i=0; i<sizeof(cNumbers); i++)
 	{
-		seqNumber[comPort-1] = 0x40;
+		if (pages & (1 << i))
+			cPages[num++] = cNumbers[i];
 	}
+	if (!num)
+		return SUCCESS;
+	mobile->session.dwScanDeadline = _getTicks() + mobile->session.dwBudget;
+	mobile->session.timeouts = 0;
 
-	// calculate checksum
-	cChecksum = pTemp[0];
-	for (i=2; i<payload+6; i=i+2)
+	if (mobile->session.pipelining)
+	{
+		if (_requestPages(mobile, cPages, num, dest) != SUCCESS)
+		{
+			_countScan(mobile, E_NODATA);
+			return E_NODATA;
+		}
+	}
+	else
 	{
-		cChecksum ^= pTemp[i];	// XOR of all even/odd bytes
+		// send security string, if not done already
+		if (_requestAccess(mobile) != SUCCESS)
+		{
+			_countScan(mobile, E_NODATA);
+			return E_NODATA;		// error: nothing in input buffer, device not connected?
+		}
+
+		// walk netmonitor pages (the result is only valid until the next request)
+		for (i=0; i<num; i++)
+		{
+			if (mobile->session.timeouts)
+				continue;	// a request timed out, give up the rest of the scan
+			result = _requestPage(mobile, cPages[i]);
+			if (!result)
+				continue;	// timeout or error reply
+			answered = true;
+			_decodePage(mobile, result, mobile->rx.length-1, dest);
+		}
+		_txFlush(mobile);		// ACK of the last reply
+		if (!answered)
+		{
+			_countScan(mobile, E_NODATA);
+			return E_NODATA;		// error: device seems to be gone
+		}
 	}
-	pTemp[5+payload+1] = cChecksum;
-	cChecksum = pTemp[1];
-	for (i=3; i<payload+6; i=i+2)
+
+	if (dest->received != (pages & PAGES_ALL))
 	{
-		cChecksum ^= pTemp[i];	// XOR of all even/odd bytes
+		dest->partial = true;
+		_countScan(mobile, E_PARTIAL);
+		return E_PARTIAL;
 	}
-	pTemp[5+payload+2] = cChecksum;
+	_countScan(mobile, SUCCESS);
+	return SUCCESS;
+}
+
+
+//	void setMobilePipelining(MOBILE *mobile, bool enable)
+//	Description: switches between requesting Netmonitor pages one after another
+//	(default) and sending all requests of a query back to back, matching the
+//	replies as they arrive. Pipelining saves a round trip per page, but not every
+//	phone may cope with it.
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		enable		true to pipeline requests
+//	Return Value: none
 
-	// send over the wire
-	WriteFile(comHandles[comPort-1], pTemp, payload+8, &dwBytesWritten, NULL);
+void setMobilePipelining(MOBILE *mobile, bool enable)
+{
+	mobile->session.pipelining = enable;
 }
 
 
-//	Exported Functions
+//	void setMobileTimeouts(MOBILE *mobile, unsigned int request, unsigned int scan)
+//	Description: sets how long the phone may take to answer a request and how
+//	long a whole scan may take
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		request		miliseconds per request, 0 to adapt to the measured round
+//					trip time (see _sampleRTT())
+//		scan		miliseconds per scan, 0 for no limit
+//	Return Value: none
+
+void setMobileTimeouts(MOBILE *mobile, unsigned int request, unsigned int scan)
+{
+	mobile->session.dwTimeout = request;
+	mobile->session.dwBudget = scan;
+}
+
+
+//	void getMobileTiming(MOBILE *mobile, unsigned int *rtt, unsigned int *timeout)
+//	Description: returns the smoothed round trip time of a phone's requests
+//	and the timeout of the next request
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		rtt			receives the round trip time in miliseconds (0 before the first reply)
+//		timeout		receives the timeout in miliseconds
+//	Return Value: none
+
+void getMobileTiming(MOBILE *mobile, unsigned int *rtt, unsigned int *timeout)
+{
+	*rtt = (unsigned int)(mobile->session.fRTT + 0.5f);
+	*timeout = mobile->session.dwTimeout ? mobile->session.dwTimeout : mobile->session.dwRTO;
+}
+
+
+//	void getMobileStats(MOBILE *mobile, STATS *dest)
+//	Description: reads the counters of a phone (see STATS in libNokiaNetmon.h)
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		dest		pointer to a STATS struct being filled
+//	Return Value: none
+//	Notes: Only the thread using the handle (or the reactor) writes the
+//	counters, each one with a single store (see COUNT()), so other threads may
+//	read them without locking. Counters read during a scan may not agree with
+//	each other yet.
+
+void getMobileStats(MOBILE *mobile, STATS *dest)
+{
+	unsigned int i;
+
+	dest->time = (unsigned int)(_getTicks() - mobile->dwOpened);
+	dest->scans = COUNTER(mobile->stats.scans);
+	dest->partial = COUNTER(mobile->stats.partial);
+	dest->failed = COUNTER(mobile->stats.failed);
+	dest->framesSent = COUNTER(mobile->stats.framesSent);
+	dest->framesReceived = COUNTER(mobile->rx.frames);
+	dest->acksSent = COUNTER(mobile->stats.acksSent);
+	dest->writes = COUNTER(mobile->stats.writes);
+	dest->checksumErrors = COUNTER(mobile->rx.badChecksums);
+	dest->bytesDiscarded = COUNTER(mobile->rx.discarded);
+	dest->malformedLines = COUNTER(mobile->stats.malformedLines);
+	for (i=0; i<STATS_REQUESTS; i++)
+		dest->timeouts[i] = COUNTER(mobile->stats.timeouts[i]);
+	for (i=0; i<STATS_RTT; i++)
+		dest->rtt[i] = COUNTER(mobile->stats.rtt[i]);
+}
+
+
+//	void setMobileTrace(MOBILE *mobile, TRACEPROC proc, void *user)
+//	Description: starts or stops tracing the scans of a phone
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		proc		function called at each of the TRACEPOINTS, NULL to stop tracing
+//		user		passed to proc
+//	Return Value: none
+
+void setMobileTrace(MOBILE *mobile, TRACEPROC proc, void *user)
+{
+	mobile->traceProc = proc;
+	mobile->traceUser = user;
+}
+
+
+//	void setMobilePages(MOBILE *mobile, unsigned int pages)
+//	Description: sets the pages a reactor requests in the following scans of
+//	a phone
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		pages		PAGE_* flags, 0 to pause scanning for a moment
+//	Return Value: none
+
+void setMobilePages(MOBILE *mobile, unsigned int pages)
+{
+	mobile->session.pages = pages & PAGES_ALL;
+}
+
+
+//	void closeMobile(MOBILE *mobile)
+//	Description: closes the serial device of a phone and frees its handle
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//	Return Value: none
+
+void closeMobile(MOBILE *mobile)
+{
+	_closePort(mobile->handle);
+	free(mobile);
+}
+
+
+//	MOBILE* _getMobile(unsigned int comPort)
+//	Description: looks up the phone opened under a COM port number
+//	Parameters:
+//		comPort		number of COM port
+//	Return Value: handle of the phone, NULL if the number is invalid or not connected
+
+MOBILE* _getMobile(unsigned int comPort)
+{
+	if (comPort < 1 || comPort > sizeof(mobiles)/sizeof(mobiles[0]))
+		return NULL;
+	return mobiles[comPort-1];
+}
 
 
 //  ERRORS connectMobile(unsigned int comPort)
 //	Description: opens COM port to FBUS enabled mobile and sends initialization string.
 //	Parameters
-//		comPort		number of COM port (valid: 1-4)
+//		comPort		number of COM port (valid: 1-128)
 //	Return Value: SUCCESS (0) or an error code as specified in ERROR (libNokiaNetmon.h)
+//	Notes: On POSIX systems COM port n is mapped to /dev/ttyS(n-1), use
+//	connectMobileDevice() for other devices.
 
 ERRORS connectMobile(unsigned int comPort)
 {
-	DCB dcb;
-	HANDLE handle;
-	char cComPort[11];
-	static char init_char = 0x55;		// character used for device initialization
-	unsigned int i;
-
 	// check comPort
-	if (comPort < 1 || comPort > sizeof(comHandles))
+	if (comPort < 1 || comPort > sizeof(mobiles)/sizeof(mobiles[0]))
 		return E_INVALIDPORT;	// error: invalid COM port
-	if (comHandles[comPort-1] != 0)
+	if (mobiles[comPort-1])
 		return E_ALREADYOPEN;	// error: COM port already open
 
-	// create (magic) filename (needed for COM ports > 10)
-	sprintf_s(cComPort, sizeof(cComPort), "\\\\.\\COM%u", comPort);
-
-	// create file
-	handle = CreateFile(cComPort, GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-
-	if (handle == INVALID_HANDLE_VALUE)
-		return E_CANTOPENPORT;	// error cannot open COM port
-
-	// probe COM state in order to fill the DCB struct
-	if (!GetCommState(handle, &dcb))
-		return E_GETPORTSTATE;	// error: cannot get COM port state
-
-	dcb.DCBlength = sizeof(DCB);
-	// fill Nokia 3310 specific parameters in struct
-	dcb.BaudRate = CBR_115200;
-	dcb.ByteSize = 8;
-	dcb.Parity = NOPARITY;
-	dcb.StopBits = ONESTOPBIT;
-	// flow control (setting fDtrControl is necessary, not sure about the others)
-	dcb.fOutxDsrFlow = 0;
-	dcb.fDtrControl = DTR_CONTROL_ENABLE;
-	dcb.fOutxCtsFlow = 0;
-	dcb.fRtsControl = DTR_CONTROL_DISABLE;
-	dcb.fInX = 0;
-	dcb.fOutX = 0;
+	return openMobilePort(comPort, &mobiles[comPort-1]);
+}
 
-	// set COM state
-	if (!SetCommState(handle, &dcb))
-		return E_SETPORTSTATE;	// error: cannot set COM port state
 
-	// send init string (128 times 0x55 to synch with the UART)
-	DWORD dwBytesWritten;		// unused
-	for (i=0; i<128; i++)
-	{
-		// one source recommends sleeping for 10 miliseconds, but seems to work fine
-		if (!WriteFile(handle, &init_char, 1, &dwBytesWritten, NULL))
-			return E_SENDINITSTRING;
-	}
+//  ERRORS connectMobileDevice(unsigned int comPort, const char *device)
+//	Description: opens a serial device connected to an FBUS enabled mobile, sends
+//	the initialization string and makes it available under a COM port number.
+//	Parameters
+//		comPort		number under which the device is accessed by the other functions (1-128)
+//		device		name of the serial device (e.g. /dev/ttyUSB0)
+//	Return Value: SUCCESS (0) or an error code as specified in ERROR (libNokiaNetmon.h)
 
-	// store handle in global variable
-	comHandles[comPort-1] = handle;
+ERRORS connectMobileDevice(unsigned int comPort, const char *device)
+{
+	// check comPort
+	if (comPort < 1 || comPort > sizeof(mobiles)/sizeof(mobiles[0]))
+		return E_INVALIDPORT;	// error: invalid COM port
+	if (mobiles[comPort-1])
+		return E_ALREADYOPEN;	// error: COM port already open
 
-	return SUCCESS;
+	return openMobile(device, &mobiles[comPort-1]);
 }
 
 
 //	ERRORS getBasestations(unsigned int comPort, BASE *dest)
-//	Description: writes the channels of all GSM base stations of an FBUS enabled
-//	mobile and its signal levels to the linked list BASE. The order of the entries
-//	is determined by the phone itself, so mostly by signal strength descending
-//	(thus -dBm value increasing).
+//	Description: getMobileBasestations() for a phone opened by connectMobile()
 //	Parameters:
 //		comPort		number of already opened COM port
 //		dest		pointer to a BASE struct being filled (overwritten)
 //	Return Value: SUCCESS (0), E_NOTCONNECTED if the COM port has not been opened yet
 //	or E_NODATA if the device seems not connected
-//	Notes: If communication with the device works but the device sees no single base
-//	station, this function returns SUCCESS nontheless, but channel/p[ower] of dest
-//	will be 0. *pNext of the last entry is NULL. The caller must not forget to free all
-//	structs but dest.
 
 ERRORS getBasestations(unsigned int comPort, BASE *dest)
 {
-	BASE *pCur = NULL;
-	char *result;
-	char cTemp[4];
-	char cTeststring[] = { 0x7e, 0x00 };	// arguments for netmonitor tests
-	unsigned int line, page;
+	MOBILE *mobile = _getMobile(comPort);
 
-	// check parameters
-	if (comHandles[comPort-1] == 0)
+	if (!mobile)
 		return E_NOTCONNECTED;	// error: COM port is not connected
+	return getMobileBasestations(mobile, dest);
+}
 
-	// write default values in dest
-	dest->channel = 0;
-	dest->p = 0;
-	dest->pNext = NULL;
-
-	// send security string
-	_sendFrame(comPort, 0x40, "\x64\x01", 2);	// necessary for reading netmonitor values
-	result = _receiveFrame(comPort, 0x40);		// wait for any return
-	if (!result)
-		return E_NODATA;		// error: nothing in input buffer, device not connected?
-	free(result);
-
-	for (page=3; page<=5; page++)
-	{
-		// walk netmonitor pages
-		cTeststring[1] = page;
-		_sendFrame(comPort, 0x40, cTeststring, 2);
-
-		result = _receiveFrame(comPort, 0x40);
-		if (!result)
-			continue;	// timeout occured
-
-		// parse string
-		for (line=0; line<=2; line++)
-		{
-			if ((line*13)+12 > strlen(result))
-				continue;	// BUG: not enough bytes for parsing returned
 
-			strncpy_s(cTemp, sizeof(cTemp), result+(line*13)+4, 3);	// copy channel number
-			cTemp[3] = '\0';
-			if (atoi(cTemp) != 0)
-			{
-				// we have a valid channel number (ie. not xxx)
-				if (!pCur)
-				{
-					pCur = dest;
-				}
-				else
-				{
-					pCur->pNext = (BASE*)malloc(sizeof(BASE));
-					pCur = pCur->pNext;
-				}
-
-				pCur->channel = atoi(cTemp);
-
-				// check if signal strength has two or three digits
-				if (*(result+(line*13)+10) == '-')
-				{
-					strncpy_s(cTemp, sizeof(cTemp), result+(line*13)+11, 2);
-					cTemp[2] = '\0';
-				}
-				else
-				{
-					strncpy_s(cTemp, sizeof(cTemp), result+(line*13)+10, 3);
-					cTemp[3] = '\0';
-				}
-				pCur->p = atoi(cTemp);
-			}
-		}
+//	ERRORS getBasestationArray(unsigned int comPort, CELL *dest, unsigned int size, unsigned int *num)
+//	Description: getMobileBasestationArray() for a phone opened by connectMobile()
+//	Parameters:
+//		comPort		number of already opened COM port
+//		dest		array being filled
+//		size		number of entries in dest (MAX_BASESTATIONS is always sufficient)
+//		num			receives the number of entries filled
+//	Return Value: SUCCESS (0), E_NOTCONNECTED if the COM port has not been opened yet
+//	or E_NODATA if the device seems not connected
 
-		// free buffer
-		free(result);
-	}
-	// set the pNext of the last element to NULL
-	if (pCur)
-		pCur->pNext = NULL;
+ERRORS getBasestationArray(unsigned int comPort, CELL *dest, unsigned int size, unsigned int *num)
+{
+	MOBILE *mobile = _getMobile(comPort);
 
-	return SUCCESS;
+	*num = 0;
+	if (!mobile)
+		return E_NOTCONNECTED;	// error: COM port is not connected
+	return getMobileBasestationArray(mobile, dest, size, num);
 }
 
 
 //	ERRORS getLocation(unsigned int comPort, LOC *dest)
-//	Description: writes information regarding the currently used GSM network
-//	cell in struct LOC (see libNokiaNetmon.h)
+//	Description: getMobileLocation() for a phone opened by connectMobile()
 //	Parameters:
 //		comPort		number of already opened COM port
 //		dest		pointer to a LOC struct being filled
@@ -448,52 +1906,27 @@ ERRORS getBasestations(unsigned int comPort, BASE *dest)
 
 ERRORS getLocation(unsigned int comPort, LOC *dest)
 {
-	char *pTemp, *result;
-	char cTemp[6];
+	MOBILE *mobile = _getMobile(comPort);
 
-	// check parameters
-	if (comHandles[comPort-1] == 0)
+	if (!mobile)
 		return E_NOTCONNECTED;	// error: COM port is not connected
+	return getMobileLocation(mobile, dest);
+}
 
-	// send security string
-	_sendFrame(comPort, 0x40, "\x64\x01", 2);	// necessary for reading netmonitor values
-	result = _receiveFrame(comPort, 0x40);
-	if (!result)
-		return E_NODATA;		// error: nothing in input buffer, device not connected?
-	free(result);
-
-	// aquire netmonitor test data
-	_sendFrame(comPort, 0x40, "\x7e\x0b", 2);
-	result = _receiveFrame(comPort, 0x40);
-	if (!result)
-		return E_NODATA;		// BUG: device is connected, else would previous _receiveFrame fail
-	
-	if (strlen(result) < 48)
-	{
-		free(result);
-		return E_NODATA;		// BUG: not enough bytes for parsing returned
-	}
-
-	// parse string
-	strncpy_s(cTemp, sizeof(cTemp), result+7, 3);
-	dest->country = atoi(cTemp);
-	strncpy_s(cTemp, sizeof(cTemp), result+13, 3);
-	dest->network = atoi(cTemp);
-
-	pTemp = result+21;
-	while (*pTemp == ' ')
-		pTemp++;			// area is right-aligned
-	strncpy_s(cTemp, sizeof(cTemp), pTemp, 6-(pTemp-result-20));
-	dest->area = atoi(cTemp);
 
-	strncpy_s(cTemp, sizeof(cTemp), result+34, 3);
-	dest->channel = atoi(cTemp);
-	strncpy_s(cTemp, sizeof(cTemp), result+43, 5);
-	dest->cell = atoi(cTemp);
+//	void setPipelining(unsigned int comPort, bool enable)
+//	Description: setMobilePipelining() for a phone opened by connectMobile()
+//	Parameters:
+//		comPort		number of COM port
+//		enable		true to pipeline requests
+//	Return Value: none
 
-	free(result);
+void setPipelining(unsigned int comPort, bool enable)
+{
+	MOBILE *mobile = _getMobile(comPort);
 
-	return SUCCESS;
+	if (mobile)
+		setMobilePipelining(mobile, enable);
 }
 
 
@@ -505,6 +1938,10 @@ ERRORS getLocation(unsigned int comPort, LOC *dest)
 
 void disconnectMobile(unsigned int comPort)
 {
-	CloseHandle(comHandles[comPort-1]);
-	comHandles[comPort-1] = 0;
-}
\ No newline at end of file
+	MOBILE *mobile = _getMobile(comPort);
+
+	if (!mobile)
+		return;
+	closeMobile(mobile);
+	mobiles[comPort-1] = NULL;
+}
@@ -21,7 +21,21 @@
 //	Defines
 
 
-#define TIMEOUT 2000		// interval in miliseconds we wait for RS-232 input
+#define TIMEOUT 2000		// interval in miliseconds we wait for RS-232 input (default, see setMobileTimeouts())
+#define TIMEOUT_MIN 100		// lower bound of the timeout adapted to the round trip time
+#define MAX_BASESTATIONS 9	// pages 3, 4 and 5 show up to three cells each
+#define PAGE_CELLS 3		// cells per page
+
+// Netmonitor pages, as flags (see getMobilePages())
+#define PAGE_3		0x01	// cells 1 to 3
+#define PAGE_4		0x02	// cells 4 to 6
+#define PAGE_5		0x04	// cells 7 to 9
+#define PAGE_0B		0x08	// serving cell (LOC)
+#define PAGES_CELLS	(PAGE_3|PAGE_4|PAGE_5)
+#define PAGES_ALL	(PAGES_CELLS|PAGE_0B)
+
+#define STATS_REQUESTS	5	// kinds of requests counted in STATS.timeouts
+#define STATS_RTT		10	// buckets of the round trip time histogram in STATS.rtt
 
 
 //	Structs
@@ -35,6 +49,16 @@ struct _BASE
 };
 typedef _BASE BASE;
 
+typedef struct
+{
+	unsigned short	channel;	// GSM channel number
+	unsigned int	p;			// signal strength in -p dBm (so less is better)
+} CELL;
+
+typedef struct _MOBILE MOBILE;	// connected phone, opaque (see openMobile())
+
+typedef struct _SCANLOG SCANLOG;	// scan log being recorded or replayed, opaque (see createLog())
+
 typedef struct
 {
 	unsigned int	country;	// Mobile Country Code (MCC, Austria is 232)
@@ -44,6 +68,43 @@ typedef struct
 	unsigned short	channel;	// Channel of cell
 } LOC;
 
+typedef struct
+{
+	unsigned int	received;	// PAGE_* flags of the pages received
+	CELL			cells[3][PAGE_CELLS];	// cells on pages 3, 4 and 5
+	unsigned int	num[3];		// number of entries in cells per page
+	LOC				loc;		// serving cell from page 0x0b
+	bool			partial;	// not all pages requested have been received (see E_PARTIAL)
+	unsigned int	malformed;	// PAGE_* flags of the pages with lines which could not be decoded
+} PAGES;
+
+
+typedef struct
+{
+	unsigned int	time;			// miliseconds since the phone has been opened
+	unsigned int	scans;			// scans which talked to the phone (see getMobilePages())
+	unsigned int	partial;		// of which returned E_PARTIAL
+	unsigned int	failed;			// of which returned E_NODATA
+	unsigned int	framesSent;		// requests sent (ACKs not included)
+	unsigned int	framesReceived;	// valid frames received (ACKs of the phone included)
+	unsigned int	acksSent;		// ACKs sent for frames received
+	unsigned int	writes;			// writes to the port, ACKs share them with the next request
+	unsigned int	checksumErrors;	// frames dropped because of a wrong checksum
+	unsigned int	bytesDiscarded;	// bytes dropped while resynchronizing on the next frame
+	unsigned int	malformedLines;	// lines of pages received which could not be decoded
+	unsigned int	timeouts[STATS_REQUESTS];	// requests given up: security command, pages 3, 4, 5 and 0x0b
+	unsigned int	rtt[STATS_RTT];	// replies by round trip time: [0] below 2 ms, [n] 2^n to 2^(n+1)-1 ms, the last one longer
+} STATS;
+
+
+// points of a scan which can be traced (see setMobileTrace())
+typedef enum
+{
+	TRACE_REQUEST,			// request written to the port, arg: page (0x64 for the security command)
+	TRACE_FIRSTBYTE,		// first bytes read after a request, arg: number of bytes
+	TRACE_FRAME				// valid frame received, arg: command (0x7f for ACKs)
+} TRACEPOINTS;
+
 
 // this is atm compatible to the error codes of libTinyGPS
 typedef enum
@@ -56,7 +117,11 @@ typedef enum
 	E_SETPORTSTATE,			// cannot set communication settings of COM port
 	E_SENDINITSTRING,		// cannot send init string
 	E_NOTCONNECTED = 16,	// COM port has not been opened yet
-	E_NODATA = 18			// nothing in input buffer, device not connected?
+	E_NODATA = 18,			// nothing in input buffer, device not connected?
+	E_CANTCREATE = 20,		// cannot create reactor or watch port (see createReactor())
+	E_CANTOPENLOG = 21,		// cannot open, create or write scan log
+	E_INVALIDLOG = 22,		// file is not a scan log or scan does not exist
+	E_PARTIAL = 23			// only some of the pages requested have been received (see getMobilePages())
 } ERRORS;
 
 
@@ -66,10 +131,20 @@ typedef enum
 //  ERRORS connectMobile(unsigned int comPort)
 //	Description: opens COM port to FBUS enabled mobile and sends initialization string.
 //	Parameters
-//		comPort		number of COM port (valid: 1-4)
+//		comPort		number of COM port (valid: 1-128)
 //	Return Value: SUCCESS (0) or an error code as specified in ERROR
+//	Notes: On POSIX systems COM port n is mapped to /dev/ttyS(n-1).
 ERRORS connectMobile(unsigned int comPort);
 
+//  ERRORS connectMobileDevice(unsigned int comPort, const char *device)
+//	Description: opens a serial device connected to an FBUS enabled mobile, sends
+//	the initialization string and makes it available under a COM port number.
+//	Parameters
+//		comPort		number under which the device is accessed by the other functions (1-128)
+//		device		name of the serial device (e.g. /dev/ttyUSB0)
+//	Return Value: SUCCESS (0) or an error code as specified in ERROR
+ERRORS connectMobileDevice(unsigned int comPort, const char *device);
+
 //	ERRORS getBasestations(unsigned int comPort, BASE *dest)
 //	Description: writes the channels of all GSM base stations of an FBUS enabled
 //	mobile and its signal levels to the linked list BASE. The order of the entries
@@ -83,9 +158,23 @@ ERRORS connectMobile(unsigned int comPort);
 //	Notes: If communication with the device works but the device sees no single base
 //	station, this function returns SUCCESS nontheless, but channel/p[ower] of dest
 //	will be 0. *pNext of the last entry is NULL. The caller must not forget to free all
-//	structs but dest.
+//	structs but dest. The security command for Netmonitor access is only sent on the
+//	first query after connecting and after timeouts or error replies.
 ERRORS getBasestations(unsigned int comPort, BASE *dest);
 
+//	ERRORS getBasestationArray(unsigned int comPort, CELL *dest, unsigned int size, unsigned int *num)
+//	Description: like getBasestations(), but writes the base stations to an array
+//	provided by the caller instead of a linked list, so no memory is allocated
+//	Parameters:
+//		comPort		number of already opened COM port
+//		dest		array being filled, in the order determined by the phone
+//		size		number of entries in dest (MAX_BASESTATIONS is always sufficient)
+//		num			receives the number of entries filled (0 if the device sees no
+//					single base station)
+//	Return Value: SUCCESS (0), E_NOTCONNECTED if the COM port has not been opened yet
+//	or E_NODATA if the device seems not connected
+ERRORS getBasestationArray(unsigned int comPort, CELL *dest, unsigned int size, unsigned int *num);
+
 //	ERRORS getLocation(unsigned int comPort, LOC *dest)
 //	Description: writes information regarding the currently used GSM network
 //	cell in struct LOC
@@ -99,6 +188,17 @@ ERRORS getLocation(unsigned int comPort, LOC *dest);
 //	Return Value: SUCCESS (0), E_NOTCONNECTED if the COM port has not been opened or 
 //	E_NODATA if the device setLocation(unsigned int comPort, LOC *dest);
 
+//	void setPipelining(unsigned int comPort, bool enable)
+//	Description: switches between requesting Netmonitor pages one after another
+//	(default) and sending all requests of getBasestations()/getLocation() back to
+//	back, matching the replies as they arrive. Pipelining saves a round trip per
+//	page, but not every phone may cope with it.
+//	Parameters:
+//		comPort		number of COM port
+//		enable		true to pipeline requests
+//	Return Value: none
+void setPipelining(unsigned int comPort, bool enable);
+
 //	void disconnectMobile(unsigned int comPort)
 //	Description: frees a COM Port
 //	Parameters:
@@ -107,4 +207,259 @@ ERRORS getLocation(unsigned int comPort, LOC *dest);
 void disconnectMobile(unsigned int comPort);
 
 
-#endif		// LIBNOKIANETMON_H
\ No newline at end of file
+// The functions above address phones by COM port number and share a table of
+// connections. The following take a handle which owns everything needed for
+// one phone (port, sequence number, receive buffer, Netmonitor session), so
+// any number of phones can be polled from different threads.
+
+//	ERRORS openMobile(const char *device, MOBILE **dest)
+//	Description: opens a serial device connected to an FBUS enabled mobile and
+//	sends the initialization string
+//	Parameters:
+//		device		name of the serial device (e.g. \\.\COM1 or /dev/ttyUSB0)
+//		dest		receives the handle of the phone
+//	Return Value: SUCCESS (0) or an error code as specified in ERROR
+//	Notes: The handle has to be freed by closeMobile(). A handle must only be used
+//	by one thread at a time.
+ERRORS openMobile(const char *device, MOBILE **dest);
+
+//	ERRORS openMobilePort(unsigned int comPort, MOBILE **dest)
+//	Description: openMobile() for the serial device of a COM port number
+//	Notes: On POSIX systems COM port n is mapped to /dev/ttyS(n-1).
+ERRORS openMobilePort(unsigned int comPort, MOBILE **dest);
+
+//	ERRORS getMobileBasestations(MOBILE *mobile, BASE *dest)
+//	Description: getBasestations() for a handle returned by openMobile()
+//	Return Value: SUCCESS (0) or E_NODATA if the device seems not connected
+ERRORS getMobileBasestations(MOBILE *mobile, BASE *dest);
+
+//	ERRORS getMobileBasestationArray(MOBILE *mobile, CELL *dest, unsigned int size, unsigned int *num)
+//	Description: getBasestationArray() for a handle returned by openMobile()
+//	Return Value: SUCCESS (0) or E_NODATA if the device seems not connected
+//	Notes: Pages which timed out are left out, like getBasestationArray() does.
+ERRORS getMobileBasestationArray(MOBILE *mobile, CELL *dest, unsigned int size, unsigned int *num);
+
+//	ERRORS getMobileLocation(MOBILE *mobile, LOC *dest)
+//	Description: getLocation() for a handle returned by openMobile()
+//	Return Value: SUCCESS (0) or E_NODATA if the device seems not connected
+//	Notes: Empty fields (no service) are returned as 0. A page which cannot be
+//	decoded counts as not answered, so it returns E_NODATA.
+ERRORS getMobileLocation(MOBILE *mobile, LOC *dest);
+
+//	ERRORS getMobilePages(MOBILE *mobile, unsigned int pages, PAGES *dest)
+//	Description: requests any of the Netmonitor pages getMobileBasestationArray()
+//	and getMobileLocation() read in one query, so callers can fetch pages at
+//	different rates
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		pages		PAGE_* flags of the pages to request
+//		dest		pointer to a PAGES struct being filled, received tells
+//					which of its entries are valid
+//	Return Value: SUCCESS (0), E_PARTIAL if a request timed out or the scan
+//	ran out of time (see setMobileTimeouts()) before all pages have been
+//	received, or E_NODATA if the device seems not connected
+//	Notes: Requesting no page at all returns SUCCESS without talking to the phone.
+//	After a timeout the pages not requested yet are given up, so a phone which
+//	stops answering costs one timeout per scan, not one per page.
+ERRORS getMobilePages(MOBILE *mobile, unsigned int pages, PAGES *dest);
+
+//	void setMobilePipelining(MOBILE *mobile, bool enable)
+//	Description: setPipelining() for a handle returned by openMobile()
+//	Return Value: none
+void setMobilePipelining(MOBILE *mobile, bool enable);
+
+//	void setMobileTimeouts(MOBILE *mobile, unsigned int request, unsigned int scan)
+//	Description: sets how long the phone may take to answer a request and how
+//	long a whole scan may take (default: TIMEOUT per request, no limit per scan)
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		request		miliseconds per request, 0 to adapt to the measured round
+//					trip time (between TIMEOUT_MIN and TIMEOUT)
+//		scan		miliseconds per scan, 0 for no limit
+//	Return Value: none
+//	Notes: Like setMobilePipelining(), this may be called from the SCANPROC.
+void setMobileTimeouts(MOBILE *mobile, unsigned int request, unsigned int scan);
+
+//	void getMobileTiming(MOBILE *mobile, unsigned int *rtt, unsigned int *timeout)
+//	Description: returns the smoothed round trip time of a phone's requests
+//	and the timeout of the next request
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		rtt			receives the round trip time in miliseconds (0 before the first reply)
+//		timeout		receives the timeout in miliseconds
+//	Return Value: none
+void getMobileTiming(MOBILE *mobile, unsigned int *rtt, unsigned int *timeout);
+
+//	void getMobileStats(MOBILE *mobile, STATS *dest)
+//	Description: reads the counters of a phone, which are kept from openMobile()
+//	on to see how well the link to the phone is doing
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		dest		pointer to a STATS struct being filled
+//	Return Value: none
+//	Notes: The counters are only written by the thread using the handle (or the
+//	reactor), but may be read from any thread without locking. Counters read
+//	during a scan may not agree with each other yet.
+void getMobileStats(MOBILE *mobile, STATS *dest);
+
+//	void (*TRACEPROC)(MOBILE *mobile, TRACEPOINTS point, unsigned int arg, void *user)
+//	Description: called by the thread using a phone (or the reactor) when a
+//	scan passes one of the TRACEPOINTS
+//	Parameters:
+//		mobile		handle passed to setMobileTrace()
+//		point		what happened
+//		arg			depends on point (see TRACEPOINTS)
+//		user		pointer passed to setMobileTrace()
+//	Notes: The function should take the time and return, it is called while
+//	the phone is waiting for requests and ACKs.
+typedef void (*TRACEPROC)(MOBILE *mobile, TRACEPOINTS point, unsigned int arg, void *user);
+
+//	void setMobileTrace(MOBILE *mobile, TRACEPROC proc, void *user)
+//	Description: starts or stops tracing the scans of a phone
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		proc		function called at each trace point, NULL to stop tracing
+//		user		passed to proc
+//	Return Value: none
+//	Notes: Like setMobilePipelining(), this may be called from the SCANPROC.
+//	Without a TRACEPROC tracing costs a test per frame.
+void setMobileTrace(MOBILE *mobile, TRACEPROC proc, void *user);
+
+//	void setMobilePages(MOBILE *mobile, unsigned int pages)
+//	Description: sets the pages a reactor requests in the following scans of
+//	a phone (default: PAGES_ALL)
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//		pages		PAGE_* flags, 0 to pause scanning for a moment
+//	Return Value: none
+//	Notes: Like setMobilePipelining(), this may be called from the SCANPROC.
+void setMobilePages(MOBILE *mobile, unsigned int pages);
+
+//	void closeMobile(MOBILE *mobile)
+//	Description: closes the serial device of a phone and frees its handle
+//	Parameters:
+//		mobile		handle returned by openMobile()
+//	Return Value: none
+void closeMobile(MOBILE *mobile);
+
+
+// Instead of one thread per phone, any number of handles can be driven by a
+// reactor: a single thread which waits for all ports at once (epoll) and keeps
+// the deadlines of all requests in a timer wheel, scanning every phone over
+// and over. Only available on POSIX systems.
+
+typedef struct _REACTOR REACTOR;
+
+//	void (*SCANPROC)(MOBILE *mobile, ERRORS err, const PAGES *pages, void *user)
+//	Description: called by the reactor thread after each scan of a phone
+//	Parameters:
+//		mobile		handle passed to addMobile()
+//		err			SUCCESS (0), E_PARTIAL or E_NODATA (see getMobilePages())
+//		pages		pages received (see getMobilePages())
+//		user		pointer passed to addMobile()
+//	Notes: pages is only valid during the call. The next scan of the phone
+//	starts when the function returns, so it should not block. If no pages
+//	were to be requested (see setMobilePages()), the scan is an idle period
+//	of a few miliseconds with nothing received.
+typedef void (*SCANPROC)(MOBILE *mobile, ERRORS err, const PAGES *pages, void *user);
+
+//	ERRORS createReactor(REACTOR **dest)
+//	Description: creates a reactor and starts its thread
+//	Parameters:
+//		dest		receives the handle of the reactor
+//	Return Value: SUCCESS (0) or E_CANTCREATE if the reactor could not be created
+ERRORS createReactor(REACTOR **dest);
+
+//	ERRORS addMobile(REACTOR *reactor, MOBILE *mobile, SCANPROC proc, void *user)
+//	Description: hands a phone opened by openMobile() over to a reactor, which
+//	starts scanning it (the pages set by setMobilePages(), pipelined if enabled
+//	by setMobilePipelining())
+//	Parameters:
+//		reactor		handle returned by createReactor()
+//		mobile		handle returned by openMobile()
+//		proc		function called after each scan
+//		user		passed to proc
+//	Return Value: SUCCESS (0) or E_CANTCREATE if the port cannot be watched
+//	Notes: The handle must not be used otherwise until removeMobile() returned.
+ERRORS addMobile(REACTOR *reactor, MOBILE *mobile, SCANPROC proc, void *user);
+
+//	void removeMobile(REACTOR *reactor, MOBILE *mobile)
+//	Description: stops scanning a phone, it may be closed afterwards
+//	Parameters:
+//		reactor		handle returned by createReactor()
+//		mobile		handle passed to addMobile()
+//	Return Value: none
+//	Notes: Waits for the reactor thread to let go of the phone. Called from a
+//	SCANPROC, the phone is only let go of after the SCANPROC returned.
+void removeMobile(REACTOR *reactor, MOBILE *mobile);
+
+//	void destroyReactor(REACTOR *reactor)
+//	Description: stops the reactor thread and frees the reactor. Phones still
+//	added are not being closed.
+//	Parameters:
+//		reactor		handle returned by createReactor()
+//	Return Value: none
+void destroyReactor(REACTOR *reactor);
+
+
+// Scans can be recorded into a binary log and replayed later, e.g. to
+// rehearse without a phone. Logs are append-only files with one fixed-size
+// record (timestamp, cells and LOC) per scan, so seeking to a point in time
+// is a binary search in the memory-mapped file.
+
+//	ERRORS createLog(const char *file, SCANLOG **dest)
+//	Description: creates (or truncates) a scan log for recording
+//	Parameters:
+//		file		name of the file
+//		dest		receives the handle of the log
+//	Return Value: SUCCESS (0) or E_CANTOPENLOG
+ERRORS createLog(const char *file, SCANLOG **dest);
+
+//	ERRORS appendLog(SCANLOG *log, unsigned long long time, const CELL *cells, unsigned int num, const LOC *loc)
+//	Description: appends a scan to a log created by createLog()
+//	Parameters:
+//		log			handle returned by createLog()
+//		time		timestamp in microseconds, not less than the one of the last scan
+//		cells		base stations (at most MAX_BASESTATIONS are stored)
+//		num			number of entries in cells
+//		loc			serving cell
+//	Return Value: SUCCESS (0) or E_CANTOPENLOG if the record could not be written
+ERRORS appendLog(SCANLOG *log, unsigned long long time, const CELL *cells, unsigned int num, const LOC *loc);
+
+//	ERRORS openLog(const char *file, SCANLOG **dest)
+//	Description: maps a scan log into memory for replay
+//	Parameters:
+//		file		name of the file
+//		dest		receives the handle of the log
+//	Return Value: SUCCESS (0), E_CANTOPENLOG or E_INVALIDLOG if the file is
+//	not a scan log
+ERRORS openLog(const char *file, SCANLOG **dest);
+
+//	unsigned int getLogLength(SCANLOG *log)
+//	Description: returns the number of scans in a log opened by openLog()
+unsigned int getLogLength(SCANLOG *log);
+
+//	unsigned int seekLog(SCANLOG *log, unsigned long long time)
+//	Description: finds the first scan of a log opened by openLog() which has
+//	been recorded at or after a point in time (in microseconds)
+//	Return Value: index of the scan, getLogLength() if there is none
+unsigned int seekLog(SCANLOG *log, unsigned long long time);
+
+//	ERRORS readLog(SCANLOG *log, unsigned int index, unsigned long long *time, CELL *cells, unsigned int *num, LOC *loc)
+//	Description: reads a scan of a log opened by openLog()
+//	Parameters:
+//		log			handle returned by openLog()
+//		index		zero-based number of the scan
+//		time		receives the timestamp in microseconds
+//		cells		array being filled (MAX_BASESTATIONS entries)
+//		num			receives the number of entries filled
+//		loc			pointer to a LOC struct being filled
+//	Return Value: SUCCESS (0) or E_INVALIDLOG if index is out of range
+ERRORS readLog(SCANLOG *log, unsigned int index, unsigned long long *time, CELL *cells, unsigned int *num, LOC *loc);
+
+//	void closeLog(SCANLOG *log)
+//	Description: closes a log opened by createLog() or openLog() and frees its handle
+void closeLog(SCANLOG *log);
+
+
+#endif		// LIBNOKIANETMON_H
@@ -0,0 +1,251 @@
+//
+//	Object: libNokiaNetmonInternal.h
+//	Version: 1.1
+//	Author: Gottfried Haider
+//	Last Change: 17.10.2026
+//	Developed with: Microsoft Visual C++ 8.0, GCC 12
+//
+//	Description: internals of the Nokia Netmonitor library (frame parser,
+//	frame construction, page decoding) which are shared with the tools in
+//	this repository, such as netmonBench. Applications only include
+//	libNokiaNetmon.h.
+//
+
+#ifndef LIBNOKIANETMONINTERNAL_H
+#define LIBNOKIANETMONINTERNAL_H
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "libNokiaNetmon.h"
+
+
+//	Defines
+
+
+#define FRAME_MAX	264		// maximum size of an FBUS frame on the wire
+#define FRAME_HEADER	6	// bytes before the payload (frame id, destination, sender, command, length)
+#define RXBUF_SIZE	256		// size of the receive ring buffer per COM port (power of two)
+#define PAGE_TEXT	4		// offset of the first line of a Netmonitor page (after 0x01 0x7e <page> 0x00)
+#define PAGE_LINE	13		// distance between the lines of a page (12 characters and 0x00)
+#define PAGE_COLUMNS	12	// characters per line
+#define ACK_SIZE	10		// bytes of an acknowledge frame on the wire
+#define TXBUF_SIZE	(FRAME_MAX + 8*ACK_SIZE)	// size of the transmit queue per COM port (a frame and the ACKs before it)
+
+#define FBUS_CABLE		0x1e	// FBUS frame id (cable)
+#define FBUS_PHONE		0x00	// address of the phone
+#define FBUS_TERMINAL	0x0c	// address of the terminal (us)
+#define FBUS_NETMON		0x40	// command of security and Netmonitor requests
+#define FBUS_ACK		0x7f	// command of acknowledge frames
+
+// counters of STATS are written by the thread using a phone and may be read by
+// any other thread (see getMobileStats()), so each one is loaded and stored whole
+#ifdef _WIN32
+#define COUNT(c, n)		(*(volatile unsigned int*)&(c) = (c) + (n))
+#define COUNTER(c)		(*(volatile const unsigned int*)&(c))
+#else
+#define COUNT(c, n)		__atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define COUNTER(c)		__atomic_load_n(&(c), __ATOMIC_RELAXED)
+#endif
+
+
+//	Frame Layout
+
+
+// offsets of the header bytes of an FBUS frame (shared by frame parser and construction)
+enum
+{
+	FBUS_FRAMEID,		// FBUS_CABLE
+	FBUS_DEST,			// destination
+	FBUS_SRC,			// sender
+	FBUS_CMD,			// command
+	FBUS_LENMSB,		// MSB of payload length (always 0)
+	FBUS_LENLSB,		// payload length, without the padding byte
+	FBUS_PAYLOAD		// payload (last byte is the sequence number)
+};
+
+// bytes of a frame before its checksums: header, payload and a padding byte
+// after an odd payload length, so that the checksums start at an even offset
+inline constexpr unsigned int _frameChecksums(unsigned int length)
+{
+	return FBUS_PAYLOAD + length + (length & 1);
+}
+
+// a request from terminal to phone whose arguments are fixed: header, payload
+// of 0x00 0x01, ARGS bytes of arguments, 0x01 and the sequence number, and the
+// checksums. The frame is built at compile time with a sequence number of 0,
+// sending it only patches the sequence number and one checksum byte (see
+// _buildFrame()).
+template <unsigned int ARGS>
+struct FRAMETEMPLATE
+{
+	enum
+	{
+		LENGTH = ARGS + 4,					// payload length
+		SEQ = FBUS_PAYLOAD + LENGTH - 1,	// offset of the sequence number
+		CHECKSUMS = _frameChecksums(LENGTH),	// offset of the checksum of even bytes
+		SIZE = CHECKSUMS + 2				// bytes on the wire
+	};
+	char			bytes[SIZE];
+};
+
+// args is a string literal, the terminating 0x00 is not sent
+template <unsigned int N>
+constexpr FRAMETEMPLATE<N-1> _frameTemplate(char cmd, const char (&args)[N])
+{
+	typedef FRAMETEMPLATE<N-1> FRAME;
+	FRAME frame = {};
+	unsigned int i = 0;
+
+	frame.bytes[FBUS_FRAMEID] = FBUS_CABLE;
+	frame.bytes[FBUS_DEST] = FBUS_PHONE;
+	frame.bytes[FBUS_SRC] = FBUS_TERMINAL;
+	frame.bytes[FBUS_CMD] = cmd;
+	frame.bytes[FBUS_LENLSB] = FRAME::LENGTH;
+	frame.bytes[FBUS_PAYLOAD+1] = 0x01;		// first bytes of payload (seem to be static)
+	for (i=0; i<N-1; i++)
+		frame.bytes[FBUS_PAYLOAD+2+i] = args[i];	// 0x00 is a valid argument
+	frame.bytes[FBUS_PAYLOAD+N+1] = 0x01;	// also static?
+	for (i=0; i<FRAME::CHECKSUMS; i++)
+		frame.bytes[FRAME::CHECKSUMS + (i & 1)] ^= frame.bytes[i];	// XOR of even and of odd bytes
+	return frame;
+}
+
+typedef FRAMETEMPLATE<2> REQUESTFRAME;		// the security command and Netmonitor page requests
+
+static_assert(FBUS_PAYLOAD == FRAME_HEADER, "frame parser and layout disagree on the header");
+static_assert(REQUESTFRAME::CHECKSUMS % 2 == 0, "checksums must start at an even offset");
+static_assert(REQUESTFRAME::SEQ < REQUESTFRAME::CHECKSUMS, "sequence number must be covered by the checksums");
+static_assert(REQUESTFRAME::SIZE == 14, "requests are 14 bytes on the wire");
+static_assert(REQUESTFRAME::SIZE <= FRAME_MAX, "request does not fit into a frame buffer");
+
+
+// states of the frame parser, named after the byte expected next
+typedef enum
+{
+	RX_FRAMEID,		// FBUS_CABLE
+	RX_DEST,		// FBUS_TERMINAL (destination)
+	RX_SRC,			// FBUS_PHONE (sender)
+	RX_CMD,			// command
+	RX_LENMSB,		// MSB of payload length
+	RX_LENLSB,		// payload length
+	RX_PAYLOAD,		// payload (last byte is the sequence number) and padding
+	RX_CHKEVEN,		// checksum of even bytes
+	RX_CHKODD		// checksum of odd bytes
+} RXSTATES;
+
+static_assert((int)RX_PAYLOAD == (int)FBUS_PAYLOAD, "parser states must follow the header bytes");
+
+// receive state of a COM port, kept between calls of _receiveFrame()
+typedef struct
+{
+	unsigned char	ring[RXBUF_SIZE];	// bytes read but not parsed yet
+	unsigned long	head, tail;			// free running write/read positions in ring
+	RXSTATES		state;				// parser state
+	unsigned char	cmd;				// command of the current frame
+	unsigned int	length;				// payload length of the current frame
+	unsigned int	pos;				// bytes of the current frame received so far
+	unsigned int	end;				// bytes of the current frame before the checksums
+	unsigned short	sum;				// checksums calculated by _checksum()
+	unsigned char	acked;				// bit n is set when our frame with sequence number 0x4n has been acknowledged
+	unsigned int	frames;				// valid frames parsed (see STATS)
+	unsigned int	badChecksums;		// frames dropped because of a wrong checksum
+	unsigned int	discarded;			// bytes dropped while resynchronizing
+	char			frame[FRAME_MAX];	// current frame without checksums
+} RXSTATE;
+
+// transmit queue of a COM port: ACKs are held back until the next request is
+// written, so both go out in a single write (see _txFlush())
+typedef struct
+{
+	unsigned int	len;				// bytes queued
+	char			buf[TXBUF_SIZE];	// ACKs, followed by a request while it is being sent
+} TXSTATE;
+
+#ifdef _WIN32
+typedef HANDLE PORT;		// Win32 file handle of an opened COM port
+#else
+typedef int PORT;			// POSIX file descriptor of an opened tty (never 0, see _openPort())
+typedef unsigned long DWORD;
+#endif
+
+// Netmonitor session of a COM port
+typedef struct
+{
+	bool			access;				// security command has been answered, pages may be requested
+	bool			pipelining;			// send all page requests of a query back to back, see setPipelining()
+	unsigned int	pages;				// PAGE_* flags of the pages a reactor requests, see setMobilePages()
+	DWORD			dwTimeout;			// miliseconds per request, 0 to adapt to the round trip time, see setMobileTimeouts()
+	DWORD			dwBudget;			// miliseconds per scan, 0 for no limit
+	DWORD			dwScanDeadline;		// point in time the current scan ends (see _getTicks()), if dwBudget is set
+	float			fRTT;				// smoothed round trip time in miliseconds, 0 before the first reply
+	float			fRTTVar;			// mean deviation of the round trip time
+	DWORD			dwRTO;				// current adaptive timeout (see _sampleRTT())
+	unsigned int	timeouts;			// requests given up during the current scan
+} SESSION;
+
+
+// a connected phone; everything needed to talk to it lives here, so phones can
+// be polled from different threads
+struct _MOBILE
+{
+	PORT			handle;			// opened serial port
+	unsigned int	seqNumber;		// sequence number of our next frame (0x40 through 0x47)
+	RXSTATE			rx;				// receive buffer and parser state
+	TXSTATE			tx;				// ACKs not written yet
+	SESSION			session;		// Netmonitor access and options
+	STATS			stats;			// counters, the ones of the frame parser are kept in rx (see getMobileStats())
+	DWORD			dwOpened;		// point in time the phone has been opened (see _getTicks())
+	TRACEPROC		traceProc;		// called at the TRACEPOINTS, NULL if not tracing (see setMobileTrace())
+	void			*traceUser;		// passed to traceProc
+	bool			traceByte;		// a request has been written, the next bytes read are traced
+};
+
+// a request sent to the phone and waiting for its reply
+typedef struct
+{
+	char			args[2];		// command arguments (0x64 0x01 for security, 0x7e <page> for pages)
+	unsigned char	seq;			// sequence number it was sent with
+	DWORD			dwSent;			// point in time it was sent (see _getTicks())
+	bool			open;			// no reply has been received yet
+} REQUEST;
+
+
+//	Internal Functions
+
+
+// serial port backend
+DWORD _getTicks(void);
+bool _writePort(MOBILE *mobile, const char *buf, unsigned long len);
+unsigned long _readPort(MOBILE *mobile, char *buf, unsigned long len);
+// checksums
+unsigned short _checksum(const void *buf, unsigned int len);
+// frame parser
+void _rxReset(RXSTATE *rx);
+bool _rxParse(RXSTATE *rx, unsigned char c);
+unsigned long _rxWrite(RXSTATE *rx, const char *buf, unsigned long len);
+bool _rxPoll(RXSTATE *rx);
+unsigned long _rxRead(MOBILE *mobile, unsigned long lAvail);
+// frame construction
+unsigned int _requestIndex(const char *args);
+int _buildFrame(unsigned int *seqNumber, char cmd, const char* args, int len, char *pTemp);
+// timeouts
+DWORD _requestDeadline(MOBILE *mobile);
+void _sampleRTT(MOBILE *mobile, DWORD dwSent);
+void _timedOut(MOBILE *mobile);
+void _countTimeout(MOBILE *mobile, const char *args);
+void _countScan(MOBILE *mobile, ERRORS err);
+// frame exchange
+void _sendACK(MOBILE *mobile, char cmd, char seq);
+bool _txFlush(MOBILE *mobile);
+unsigned char _sendFrame(MOBILE *mobile, char cmd, const char *args, int len);
+const char* _nextFrame(MOBILE *mobile, char cmd);
+bool _isPage(const char *result, char page);
+int _matchReply(const char *result, const REQUEST *req, unsigned int num, unsigned char acked);
+// page decoding
+unsigned int _decodeCells(const char *page, unsigned int len, CELL *dest, unsigned int size, unsigned int *malformed);
+ERRORS _decodeLocation(const char *page, unsigned int len, LOC *dest, unsigned int *malformed);
+void _decodePage(MOBILE *mobile, const char *page, unsigned int len, PAGES *dest);
+
+
+#endif		// LIBNOKIANETMONINTERNAL_H
@@ -0,0 +1,339 @@
+//
+//	Object: libNokiaNetmonLog.cpp
+//	Version: 1.1
+//	Author: Gottfried Haider
+//	Last Change: 17.10.2026
+//	Developed with: Microsoft Visual C++ 8.0, GCC 12
+//
+//	Description: This file implements scan logs (see libNokiaNetmon.h): an
+//	append-only binary file with one fixed-size record per scan, which is
+//	memory-mapped for replay. As all records have the same size, record n
+//	starts at LOG_HEADER + n*LOG_RECORD and the timestamps, which never
+//	decrease, serve as seek index.
+//
+//	File format (all numbers little endian):
+//	* header: "NMLG", version (16 bit), record size (16 bit), cells per
+//	  record (16 bit), 6 bytes reserved
+//	* record: time in microseconds (64 bit), number of cells (16 bit),
+//	  MAX_BASESTATIONS times channel and p (16 bit each), country, network,
+//	  area, cell and channel of LOC (16 bit each)
+//
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libNokiaNetmon.h"
+
+
+//	Defines
+
+
+#define LOG_VERSION		1
+#define LOG_HEADER		16									// bytes before the first record
+#define LOG_RECORD		(8 + 2 + MAX_BASESTATIONS*4 + 5*2)	// bytes per record
+
+
+//	Structs
+
+
+struct _SCANLOG
+{
+	FILE				*file;			// log being recorded, NULL if replaying
+	const unsigned char	*pData;			// mapped log being replayed
+	unsigned long		lSize;			// bytes mapped
+	unsigned int		numRecords;		// records in the mapped log
+#ifdef _WIN32
+	HANDLE				hFile;
+	HANDLE				hMapping;
+#endif
+};
+
+
+//	Internal Functions
+
+
+static void _put16(unsigned char *pDest, unsigned int value)
+{
+	pDest[0] = (unsigned char)value;
+	pDest[1] = (unsigned char)(value >> 8);
+}
+
+static unsigned int _get16(const unsigned char *pSrc)
+{
+	return pSrc[0] | (pSrc[1] << 8);
+}
+
+static void _put64(unsigned char *pDest, unsigned long long value)
+{
+	unsigned int i;
+
+	for (i=0; i<8; i++)
+		pDest[i] = (unsigned char)(value >> (i*8));
+}
+
+static unsigned long long _get64(const unsigned char *pSrc)
+{
+	unsigned long long value = 0;
+	unsigned int i;
+
+	for (i=0; i<8; i++)
+		value |= (unsigned long long)pSrc[i] << (i*8);
+	return value;
+}
+
+
+//	Exported Functions
+
+
+//	ERRORS createLog(const char *file, SCANLOG **dest)
+//	Description: creates (or truncates) a scan log for recording
+//	Parameters:
+//		file		name of the file
+//		dest		receives the handle of the log
+//	Return Value: SUCCESS (0) or E_CANTOPENLOG
+
+ERRORS createLog(const char *file, SCANLOG **dest)
+{
+	unsigned char cHeader[LOG_HEADER];
+	SCANLOG *log;
+
+	log = (SCANLOG*)calloc(1, sizeof(SCANLOG));
+	if (!log)
+		return E_CANTOPENLOG;
+	log->file = fopen(file, "wb");
+	if (!log->file)
+	{
+		free(log);
+		return E_CANTOPENLOG;	// error: cannot create file
+	}
+
+	memset(cHeader, 0, sizeof(cHeader));
+	memcpy(cHeader, "NMLG", 4);
+	_put16(cHeader+4, LOG_VERSION);
+	_put16(cHeader+6, LOG_RECORD);
+	_put16(cHeader+8, MAX_BASESTATIONS);
+	if (fwrite(cHeader, LOG_HEADER, 1, log->file) != 1)
+	{
+		closeLog(log);
+		return E_CANTOPENLOG;	// error: cannot write file
+	}
+
+	*dest = log;
+	return SUCCESS;
+}
+
+
+//	ERRORS appendLog(SCANLOG *log, unsigned long long time, const CELL *cells, unsigned int num, const LOC *loc)
+//	Description: appends a scan to a log created by createLog()
+//	Parameters:
+//		log			handle returned by createLog()
+//		time		timestamp in microseconds, not less than the one of the last scan
+//		cells		base stations (at most MAX_BASESTATIONS are stored)
+//		num			number of entries in cells
+//		loc			serving cell
+//	Return Value: SUCCESS (0) or E_CANTOPENLOG if the record could not be written
+//	Notes: Each record is flushed to the file right away.
+
+ERRORS appendLog(SCANLOG *log, unsigned long long time, const CELL *cells, unsigned int num, const LOC *loc)
+{
+	unsigned char cRecord[LOG_RECORD];
+	unsigned char *pDest = cRecord;
+	unsigned int i;
+
+	if (!log->file)
+		return E_CANTOPENLOG;	// error: log has been opened for replay
+	if (num > MAX_BASESTATIONS)
+		num = MAX_BASESTATIONS;
+
+	memset(cRecord, 0, sizeof(cRecord));
+	_put64(pDest, time);
+	_put16(pDest+8, num);
+	pDest += 10;
+	for (i=0; i<num; i++)
+	{
+		_put16(pDest, cells[i].channel);
+		_put16(pDest+2, cells[i].p);
+		pDest += 4;
+	}
+	pDest = cRecord + 10 + MAX_BASESTATIONS*4;
+	_put16(pDest, loc->country);
+	_put16(pDest+2, loc->network);
+	_put16(pDest+4, loc->area);
+	_put16(pDest+6, loc->cell);
+	_put16(pDest+8, loc->channel);
+
+	if (fwrite(cRecord, LOG_RECORD, 1, log->file) != 1 || fflush(log->file) != 0)
+		return E_CANTOPENLOG;	// error: disk full?
+	return SUCCESS;
+}
+
+
+//	ERRORS openLog(const char *file, SCANLOG **dest)
+//	Description: maps a scan log into memory for replay
+//	Parameters:
+//		file		name of the file
+//		dest		receives the handle of the log
+//	Return Value: SUCCESS (0), E_CANTOPENLOG or E_INVALIDLOG if the file is
+//	not a scan log
+//	Notes: A record being written while the log was opened is ignored.
+
+ERRORS openLog(const char *file, SCANLOG **dest)
+{
+	SCANLOG *log;
+
+	log = (SCANLOG*)calloc(1, sizeof(SCANLOG));
+	if (!log)
+		return E_CANTOPENLOG;
+
+#ifdef _WIN32
+	log->hFile = CreateFile(file, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (log->hFile == INVALID_HANDLE_VALUE)
+	{
+		free(log);
+		return E_CANTOPENLOG;	// error: cannot open file
+	}
+	log->lSize = GetFileSize(log->hFile, NULL);
+	if (log->lSize >= LOG_HEADER)
+	{
+		log->hMapping = CreateFileMapping(log->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (log->hMapping)
+			log->pData = (const unsigned char*)MapViewOfFile(log->hMapping, FILE_MAP_READ, 0, 0, log->lSize);
+	}
+#else
+	struct stat st;
+	int fd;
+	void *pMap;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+	{
+		free(log);
+		return E_CANTOPENLOG;	// error: cannot open file
+	}
+	if (fstat(fd, &st) == 0 && st.st_size >= LOG_HEADER)
+	{
+		log->lSize = (unsigned long)st.st_size;
+		pMap = mmap(NULL, log->lSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (pMap != MAP_FAILED)
+			log->pData = (const unsigned char*)pMap;
+	}
+	close(fd);		// the mapping stays valid
+#endif
+
+	if (!log->pData || memcmp(log->pData, "NMLG", 4) != 0 || _get16(log->pData+4) != LOG_VERSION
+		|| _get16(log->pData+6) != LOG_RECORD || _get16(log->pData+8) != MAX_BASESTATIONS)
+	{
+		closeLog(log);
+		return E_INVALIDLOG;	// error: not a scan log (of this version)
+	}
+	log->numRecords = (log->lSize - LOG_HEADER) / LOG_RECORD;
+
+	*dest = log;
+	return SUCCESS;
+}
+
+
+//	unsigned int getLogLength(SCANLOG *log)
+//	Description: returns the number of scans in a log opened by openLog()
+
+unsigned int getLogLength(SCANLOG *log)
+{
+	return log->numRecords;
+}
+
+
+//	unsigned int seekLog(SCANLOG *log, unsigned long long time)
+//	Description: finds the first scan of a log opened by openLog() which has
+//	been recorded at or after a point in time
+//	Parameters:
+//		log			handle returned by openLog()
+//		time		timestamp in microseconds
+//	Return Value: index of the scan, getLogLength() if there is none
+//	Notes: binary search over the timestamps of the records
+
+unsigned int seekLog(SCANLOG *log, unsigned long long time)
+{
+	unsigned int lo = 0, hi = log->numRecords, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi-lo)/2;
+		if (_get64(log->pData + LOG_HEADER + (unsigned long)mid*LOG_RECORD) < time)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+//	ERRORS readLog(SCANLOG *log, unsigned int index, unsigned long long *time, CELL *cells, unsigned int *num, LOC *loc)
+//	Description: reads a scan of a log opened by openLog()
+//	Parameters:
+//		log			handle returned by openLog()
+//		index		zero-based number of the scan
+//		time		receives the timestamp in microseconds
+//		cells		array being filled (MAX_BASESTATIONS entries)
+//		num			receives the number of entries filled
+//		loc			pointer to a LOC struct being filled
+//	Return Value: SUCCESS (0) or E_INVALIDLOG if index is out of range
+
+ERRORS readLog(SCANLOG *log, unsigned int index, unsigned long long *time, CELL *cells, unsigned int *num, LOC *loc)
+{
+	const unsigned char *pSrc;
+	unsigned int i;
+
+	if (index >= log->numRecords)
+		return E_INVALIDLOG;	// error: no such scan
+
+	pSrc = log->pData + LOG_HEADER + (unsigned long)index*LOG_RECORD;
+	*time = _get64(pSrc);
+	*num = _get16(pSrc+8);
+	if (*num > MAX_BASESTATIONS)
+		*num = MAX_BASESTATIONS;	// BUG: corrupted record
+	pSrc += 10;
+	for (i=0; i<*num; i++)
+	{
+		cells[i].channel = (unsigned short)_get16(pSrc);
+		cells[i].p = _get16(pSrc+2);
+		pSrc += 4;
+	}
+	pSrc = log->pData + LOG_HEADER + (unsigned long)index*LOG_RECORD + 10 + MAX_BASESTATIONS*4;
+	loc->country = _get16(pSrc);
+	loc->network = _get16(pSrc+2);
+	loc->area = (unsigned short)_get16(pSrc+4);
+	loc->cell = (unsigned short)_get16(pSrc+6);
+	loc->channel = (unsigned short)_get16(pSrc+8);
+
+	return SUCCESS;
+}
+
+
+//	void closeLog(SCANLOG *log)
+//	Description: closes a log opened by createLog() or openLog() and frees its handle
+
+void closeLog(SCANLOG *log)
+{
+	if (log->file)
+		fclose(log->file);
+#ifdef _WIN32
+	if (log->pData)
+		UnmapViewOfFile(log->pData);
+	if (log->hMapping)
+		CloseHandle(log->hMapping);
+	if (log->hFile && log->hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(log->hFile);
+#else
+	if (log->pData)
+		munmap((void*)log->pData, log->lSize);
+#endif
+	free(log);
+}
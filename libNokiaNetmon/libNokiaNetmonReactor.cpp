@@ -0,0 +1,651 @@
+//
+//	Object: libNokiaNetmonReactor.cpp
+//	Version: 1.1
+//	Author: Gottfried Haider
+//	Last Change: 17.10.2026
+//	Developed with: GCC 12
+//
+//	Description: This file implements the reactor of the Nokia Netmonitor
+//	library (see libNokiaNetmon.h). A single thread waits for the ports of all
+//	added phones with epoll and drives a small state machine per phone which
+//	does what getMobilePages() does, but
+//	without blocking: requests are sent, ACKs and replies are handled as the
+//	bytes arrive and the deadlines of all outstanding requests are kept in a
+//	timer wheel instead of every phone waiting in its own poll() loop.
+//
+//	Notes:
+//	* POSIX (Linux) only, on Windows phones are polled by one thread each
+//	* a phone which hangs up is not watched any longer, its scans time out
+//
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "libNokiaNetmon.h"
+#include "libNokiaNetmonInternal.h"
+
+
+//	Defines
+
+
+#define WHEEL_SLOTS		256		// number of slots of the timer wheel (power of two, covers more than TIMEOUT)
+#define WHEEL_TICK		8		// miliseconds per slot
+#define MAX_EVENTS		64		// events fetched per epoll_wait()
+#define MAX_REQUESTS	5		// security command, pages 3, 4, 5 and 0x0b
+#define IDLE_WAIT		10		// miliseconds a scan without pages lasts (see setMobilePages())
+
+// flags set by other threads and polled by the reactor thread outside the mutex
+#define SET_FLAG(p)		__atomic_store_n((p), true, __ATOMIC_RELEASE)
+#define GET_FLAG(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+
+
+//	Structs
+
+
+// a phone added to the reactor and the state of its current scan
+typedef struct _ENTRY ENTRY;
+struct _ENTRY
+{
+	MOBILE			*mobile;
+	SCANPROC		proc;					// called after each scan
+	void			*user;					// passed to proc
+	// scan
+	REQUEST			req[MAX_REQUESTS];		// requests of the current scan
+	unsigned int	numReq;					// number of entries in req
+	unsigned int	numSent;				// requests sent so far
+	unsigned int	numOpen;				// requests sent but not answered
+	bool			answered;				// the phone replied at least once during this scan
+	unsigned int	wanted;					// PAGE_* flags of the pages requested
+	PAGES			pages;					// pages received so far
+	// timer wheel
+	DWORD			dwDeadline;				// point in time the open requests are given up (see _getTicks())
+	ENTRY			*pTimerNext;			// next entry in the same slot
+	ENTRY			**ppTimerPrev;			// pointer pointing to this entry, NULL if not armed
+	// reactor
+	bool			watched;				// port is registered with epoll
+	bool			remove;					// removeMobile() has been called (see SET_FLAG())
+	ENTRY			*pNext;					// next entry
+};
+
+struct _REACTOR
+{
+	int				epfd;					// epoll instance
+	int				evfd;					// eventfd waking the thread up for addMobile()/removeMobile()
+	pthread_t		thread;
+	bool			stop;					// set to end the thread (see SET_FLAG())
+	pthread_mutex_t	mutex;					// protects pEntries and pAdded against other threads
+	pthread_cond_t	removed;				// signalled when entries have been freed
+	ENTRY			*pEntries;				// phones being scanned (only changed by the thread, with mutex held)
+	ENTRY			*pAdded;				// phones added but not picked up by the thread yet
+	ENTRY			*wheel[WHEEL_SLOTS];	// armed entries by deadline
+	DWORD			dwTick;					// next tick of the wheel to be expired
+};
+
+
+//	Timer Wheel
+
+
+//	void _disarm(ENTRY *entry)
+//	Description: removes an entry from the timer wheel, if armed
+
+static void _disarm(ENTRY *entry)
+{
+	if (!entry->ppTimerPrev)
+		return;
+	*entry->ppTimerPrev = entry->pTimerNext;
+	if (entry->pTimerNext)
+		entry->pTimerNext->ppTimerPrev = entry->ppTimerPrev;
+	entry->ppTimerPrev = NULL;
+}
+
+
+//	void _arm(REACTOR *reactor, ENTRY *entry, DWORD dwDeadline)
+//	Description: (re)starts the timeout of an entry, expiring at dwDeadline
+//	(see _getTicks())
+
+static void _arm(REACTOR *reactor, ENTRY *entry, DWORD dwDeadline)
+{
+	ENTRY **ppSlot;
+	DWORD dwTick, dwNext = _getTicks() / WHEEL_TICK + 1;
+
+	_disarm(entry);
+	entry->dwDeadline = dwDeadline;
+	// round up, so an entry never expires early, and never into a slot which
+	// has been expired already (deadlines cut short by the scan's budget)
+	dwTick = (entry->dwDeadline + WHEEL_TICK-1) / WHEEL_TICK;
+	if ((long)(dwTick - dwNext) < 0)
+		dwTick = dwNext;
+	ppSlot = &reactor->wheel[dwTick & (WHEEL_SLOTS-1)];
+	entry->pTimerNext = *ppSlot;
+	if (entry->pTimerNext)
+		entry->pTimerNext->ppTimerPrev = &entry->pTimerNext;
+	entry->ppTimerPrev = ppSlot;
+	*ppSlot = entry;
+}
+
+
+//	int _nextTimeout(REACTOR *reactor)
+//	Description: calculates how long epoll_wait() may sleep
+//	Return Value: miliseconds until the next non-empty slot is due, -1 if no
+//	entry is armed
+
+static int _nextTimeout(REACTOR *reactor)
+{
+	DWORD dwNow = _getTicks();
+	long lWait;
+	unsigned int i;
+
+	for (i=0; i<WHEEL_SLOTS; i++)
+	{
+		if (reactor->wheel[(reactor->dwTick + i) & (WHEEL_SLOTS-1)])
+		{
+			lWait = (long)((reactor->dwTick + i) * WHEEL_TICK - dwNow);
+			return (lWait > 0) ? (int)lWait : 0;
+		}
+	}
+	return -1;
+}
+
+
+//	Scans
+
+
+static void _sendRequests(REACTOR *reactor, ENTRY *entry);
+
+
+//	void _startScan(REACTOR *reactor, ENTRY *entry)
+//	Description: sets up the requests of a new scan and sends the first one(s)
+
+static void _startScan(REACTOR *reactor, ENTRY *entry)
+{
+	static const char cPages[] = { 0x03, 0x04, 0x05, 0x0b };
+	unsigned int i, pages = entry->mobile->session.pages;
+
+	entry->numReq = 0;
+	entry->numSent = 0;
+	entry->numOpen = 0;
+	entry->answered = false;
+	entry->wanted = pages;
+	entry->pages.received = 0;
+	entry->pages.partial = false;
+	entry->pages.malformed = 0;
+
+	if (!pages)
+	{
+		// nothing wanted right now, ask again in a moment (see _expire())
+		_arm(reactor, entry, _getTicks() + IDLE_WAIT);
+		return;
+	}
+	entry->mobile->session.dwScanDeadline = _getTicks() + entry->mobile->session.dwBudget;
+	entry->mobile->session.timeouts = 0;
+
+	if (!entry->mobile->session.access)
+	{
+		entry->req[0].args[0] = 0x64;	// necessary for reading netmonitor values
+		entry->req[0].args[1] = 0x01;
+		entry->numReq++;
+	}
+	for (i=0; i<sizeof(cPages); i++)
+	{
+		if (!(pages & (1 << i)))
+			continue;
+		entry->req[entry->numReq].args[0] = 0x7e;	// netmonitor test
+		entry->req[entry->numReq].args[1] = cPages[i];
+		entry->numReq++;
+	}
+
+	_sendRequests(reactor, entry);
+}
+
+
+//	void _finishScan(REACTOR *reactor, ENTRY *entry)
+//	Description: reports a scan and starts the next one
+
+static void _finishScan(REACTOR *reactor, ENTRY *entry)
+{
+	ERRORS err = SUCCESS;
+
+	_disarm(entry);
+	if (entry->numReq && !entry->answered)
+		err = E_NODATA;
+	else if (entry->pages.received != entry->wanted)
+	{
+		entry->pages.partial = true;
+		err = E_PARTIAL;
+	}
+	if (entry->numReq)
+		_countScan(entry->mobile, err);
+	entry->proc(entry->mobile, err, &entry->pages, entry->user);
+
+	if (!GET_FLAG(&entry->remove))
+		_startScan(reactor, entry);
+}
+
+
+//	void _sendRequests(REACTOR *reactor, ENTRY *entry)
+//	Description: sends as many requests of the current scan as the phone may
+//	have outstanding (all of them when pipelining, otherwise one) or finishes
+//	the scan if there is nothing left to wait for
+
+static void _sendRequests(REACTOR *reactor, ENTRY *entry)
+{
+	unsigned int window = entry->mobile->session.pipelining ? MAX_REQUESTS : 1;
+	REQUEST *req;
+
+	while (entry->numSent < entry->numReq && entry->numOpen < window)
+	{
+		req = &entry->req[entry->numSent++];
+		req->dwSent = _getTicks();
+		req->seq = _sendFrame(entry->mobile, 0x40, req->args, 2);
+		req->open = true;
+		entry->numOpen++;
+	}
+
+	if (entry->numOpen)
+		_arm(reactor, entry, _requestDeadline(entry->mobile));
+	else
+		_finishScan(reactor, entry);
+}
+
+
+//	void _handleReply(REACTOR *reactor, ENTRY *entry, const char *result)
+//	Description: processes a Netmonitor reply of a phone
+
+static void _handleReply(REACTOR *reactor, ENTRY *entry, const char *result)
+{
+	MOBILE *mobile = entry->mobile;
+	REQUEST *req;
+	int match;
+
+	match = _matchReply(result, entry->req, entry->numSent, mobile->rx.acked);
+	if (match < 0)
+		return;		// late reply to a request of an earlier scan
+	req = &entry->req[match];
+	req->open = false;
+	entry->numOpen--;
+	entry->answered = true;
+	_sampleRTT(mobile, req->dwSent);
+
+	if (req->args[0] == 0x64)
+		mobile->session.access = true;
+	else if (!_isPage(result, req->args[1]))
+		mobile->session.access = false;		// error reply, ask for access again on the next scan
+	else
+		_decodePage(mobile, result, mobile->rx.length-1, &entry->pages);
+
+	_sendRequests(reactor, entry);
+}
+
+
+//	void _expire(REACTOR *reactor, ENTRY *entry)
+//	Description: gives up the open requests of a phone whose deadline passed,
+//	and with them the rest of the scan (see getMobilePages()), or ends an idle
+//	scan
+
+static void _expire(REACTOR *reactor, ENTRY *entry)
+{
+	unsigned int i;
+
+	if (!entry->numReq)
+	{
+		_finishScan(reactor, entry);
+		return;
+	}
+
+	for (i=0; i<entry->numSent; i++)
+	{
+		if (entry->req[i].open)
+			_countTimeout(entry->mobile, entry->req[i].args);
+		entry->req[i].open = false;
+	}
+	entry->numOpen = 0;
+	entry->numSent = entry->numReq;		// don't try the other pages, the phone may be gone
+	entry->mobile->session.access = false;
+	_timedOut(entry->mobile);
+
+	_finishScan(reactor, entry);
+}
+
+
+//	void _handleInput(REACTOR *reactor, ENTRY *entry, uint32_t events)
+//	Description: reads everything available on the port of a phone and
+//	processes the frames received
+
+static void _handleInput(REACTOR *reactor, ENTRY *entry, uint32_t events)
+{
+	MOBILE *mobile = entry->mobile;
+	const char *result;
+	unsigned long lRead, lTotal = 0;
+
+	do
+	{
+		lRead = _rxRead(mobile, RXBUF_SIZE);
+		lTotal += lRead;
+		while (!GET_FLAG(&entry->remove) && (result = _nextFrame(mobile, 0x40)))
+			_handleReply(reactor, entry, result);
+	}
+	while (lRead && !GET_FLAG(&entry->remove));
+	_txFlush(mobile);		// ACKs not followed by a request
+
+	if ((events & (EPOLLERR|EPOLLHUP)) && !lTotal)
+	{
+		// device went away, let the scans time out
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, mobile->handle, NULL);
+		entry->watched = false;
+	}
+}
+
+
+//	Reactor Thread
+
+
+//	int _updateEntries(REACTOR *reactor)
+//	Description: frees phones removed and picks up phones added by other threads
+//	Return Value: number of phones added, these are first in pEntries
+
+static int _updateEntries(REACTOR *reactor)
+{
+	ENTRY **ppEntry, *entry, *pAdded;
+	struct epoll_event ev;
+	bool bRemoved = false;
+	int numAdded = 0;
+
+	pthread_mutex_lock(&reactor->mutex);
+
+	for (ppEntry = &reactor->pEntries; (entry = *ppEntry); )
+	{
+		if (GET_FLAG(&entry->remove))
+		{
+			if (entry->watched)
+				epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, entry->mobile->handle, NULL);
+			_disarm(entry);
+			*ppEntry = entry->pNext;
+			free(entry);
+			bRemoved = true;
+		}
+		else
+			ppEntry = &entry->pNext;
+	}
+
+	pAdded = reactor->pAdded;
+	reactor->pAdded = NULL;
+	while ((entry = pAdded))
+	{
+		pAdded = entry->pNext;
+		entry->pNext = reactor->pEntries;
+		reactor->pEntries = entry;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = entry;
+		entry->watched = (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, entry->mobile->handle, &ev) == 0);
+		numAdded++;
+	}
+
+	if (bRemoved)
+		pthread_cond_broadcast(&reactor->removed);
+	pthread_mutex_unlock(&reactor->mutex);
+
+	return numAdded;
+}
+
+
+//	void* _reactorThread(void *lpParam)
+//	Description: waits for input and deadlines of all phones and scans them
+
+static void* _reactorThread(void *lpParam)
+{
+	REACTOR *reactor = (REACTOR*)lpParam;
+	struct epoll_event events[MAX_EVENTS];
+	ENTRY *entry, *pNew, *pNext;
+	uint64_t value;
+	DWORD dwNow;
+	int i, n;
+
+	reactor->dwTick = _getTicks() / WHEEL_TICK;
+
+	while (!GET_FLAG(&reactor->stop))
+	{
+		n = epoll_wait(reactor->epfd, events, MAX_EVENTS, _nextTimeout(reactor));
+		if (n == -1 && errno != EINTR)
+			break;		// BUG: epoll instance gone
+
+		for (i=0; i<n; i++)
+		{
+			entry = (ENTRY*)events[i].data.ptr;
+			if (!entry)
+			{
+				// addMobile() or removeMobile(), handled below
+				if (read(reactor->evfd, &value, sizeof(value)) == -1)
+					value = 0;	// BUG: woken up without reason
+			}
+			else if (!GET_FLAG(&entry->remove))
+				_handleInput(reactor, entry, events[i].events);
+		}
+
+		// expire all slots up to now
+		dwNow = _getTicks() / WHEEL_TICK;
+		for (; (long)(dwNow - reactor->dwTick) >= 0; reactor->dwTick++)
+		{
+			entry = reactor->wheel[reactor->dwTick & (WHEEL_SLOTS-1)];
+			reactor->wheel[reactor->dwTick & (WHEEL_SLOTS-1)] = NULL;
+			// entries due in a later round go back in (timeouts longer than the wheel covers)
+			pNew = NULL;
+			for (; entry; entry = pNext)
+			{
+				pNext = entry->pTimerNext;
+				entry->ppTimerPrev = NULL;
+				if ((long)(_getTicks() - entry->dwDeadline) < 0)
+				{
+					entry->pTimerNext = pNew;
+					pNew = entry;
+				}
+				else if (!GET_FLAG(&entry->remove))
+					_expire(reactor, entry);
+			}
+			for (; pNew; pNew = pNext)
+			{
+				pNext = pNew->pTimerNext;
+				pNew->pTimerNext = reactor->wheel[reactor->dwTick & (WHEEL_SLOTS-1)];
+				if (pNew->pTimerNext)
+					pNew->pTimerNext->ppTimerPrev = &pNew->pTimerNext;
+				pNew->ppTimerPrev = &reactor->wheel[reactor->dwTick & (WHEEL_SLOTS-1)];
+				reactor->wheel[reactor->dwTick & (WHEEL_SLOTS-1)] = pNew;
+			}
+		}
+
+		// entries added to the reactor start scanning right away
+		n = _updateEntries(reactor);
+		for (entry = reactor->pEntries; n--; entry = entry->pNext)
+			_startScan(reactor, entry);
+	}
+
+	return NULL;
+}
+
+
+//	Exported Functions
+
+
+//	ERRORS createReactor(REACTOR **dest)
+//	Description: creates a reactor and starts its thread
+//	Parameters:
+//		dest		receives the handle of the reactor
+//	Return Value: SUCCESS (0) or E_CANTCREATE if the reactor could not be created
+
+ERRORS createReactor(REACTOR **dest)
+{
+	REACTOR *reactor;
+	struct epoll_event ev;
+
+	reactor = (REACTOR*)calloc(1, sizeof(REACTOR));
+	if (!reactor)
+		return E_CANTCREATE;
+
+	reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+	reactor->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (reactor->epfd == -1 || reactor->evfd == -1 || epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->evfd, &ev) == -1)
+	{
+		if (reactor->epfd != -1)
+			close(reactor->epfd);
+		if (reactor->evfd != -1)
+			close(reactor->evfd);
+		free(reactor);
+		return E_CANTCREATE;	// error: cannot create epoll instance
+	}
+	pthread_mutex_init(&reactor->mutex, NULL);
+	pthread_cond_init(&reactor->removed, NULL);
+
+	if (pthread_create(&reactor->thread, NULL, _reactorThread, reactor) != 0)
+	{
+		pthread_cond_destroy(&reactor->removed);
+		pthread_mutex_destroy(&reactor->mutex);
+		close(reactor->evfd);
+		close(reactor->epfd);
+		free(reactor);
+		return E_CANTCREATE;	// error: cannot create thread
+	}
+
+	*dest = reactor;
+	return SUCCESS;
+}
+
+
+//	void _wakeReactor(REACTOR *reactor)
+//	Description: makes the reactor thread return from epoll_wait()
+
+static void _wakeReactor(REACTOR *reactor)
+{
+	uint64_t value = 1;
+
+	if (write(reactor->evfd, &value, sizeof(value)) == -1)
+		return;		// counter is saturated, the thread wakes up anyway
+}
+
+
+//	ERRORS addMobile(REACTOR *reactor, MOBILE *mobile, SCANPROC proc, void *user)
+//	Description: hands a phone over to a reactor, which starts scanning it
+//	Parameters:
+//		reactor		handle returned by createReactor()
+//		mobile		handle returned by openMobile()
+//		proc		function called after each scan
+//		user		passed to proc
+//	Return Value: SUCCESS (0) or E_CANTCREATE if the port cannot be watched
+
+ERRORS addMobile(REACTOR *reactor, MOBILE *mobile, SCANPROC proc, void *user)
+{
+	ENTRY *entry;
+
+	entry = (ENTRY*)calloc(1, sizeof(ENTRY));
+	if (!entry)
+		return E_CANTCREATE;
+	entry->mobile = mobile;
+	entry->proc = proc;
+	entry->user = user;
+
+	pthread_mutex_lock(&reactor->mutex);
+	entry->pNext = reactor->pAdded;
+	reactor->pAdded = entry;
+	pthread_mutex_unlock(&reactor->mutex);
+
+	_wakeReactor(reactor);
+	return SUCCESS;
+}
+
+
+//	ENTRY* _findEntry(ENTRY *pList, MOBILE *mobile)
+//	Description: looks up the entry of a phone in a list
+
+static ENTRY* _findEntry(ENTRY *pList, MOBILE *mobile)
+{
+	for (; pList; pList = pList->pNext)
+	{
+		if (pList->mobile == mobile)
+			return pList;
+	}
+	return NULL;
+}
+
+
+//	void removeMobile(REACTOR *reactor, MOBILE *mobile)
+//	Description: stops scanning a phone, it may be closed afterwards
+//	Parameters:
+//		reactor		handle returned by createReactor()
+//		mobile		handle passed to addMobile()
+//	Return Value: none
+
+void removeMobile(REACTOR *reactor, MOBILE *mobile)
+{
+	ENTRY **ppEntry, *entry;
+
+	pthread_mutex_lock(&reactor->mutex);
+
+	// not picked up by the thread yet
+	for (ppEntry = &reactor->pAdded; (entry = *ppEntry); ppEntry = &entry->pNext)
+	{
+		if (entry->mobile == mobile)
+		{
+			*ppEntry = entry->pNext;
+			free(entry);
+			pthread_mutex_unlock(&reactor->mutex);
+			return;
+		}
+	}
+
+	entry = _findEntry(reactor->pEntries, mobile);
+	if (entry)
+	{
+		SET_FLAG(&entry->remove);
+		if (!pthread_equal(pthread_self(), reactor->thread))
+		{
+			// wait for the thread to free the entry
+			_wakeReactor(reactor);
+			while (_findEntry(reactor->pEntries, mobile))
+				pthread_cond_wait(&reactor->removed, &reactor->mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&reactor->mutex);
+}
+
+
+//	void destroyReactor(REACTOR *reactor)
+//	Description: stops the reactor thread and frees the reactor
+//	Parameters:
+//		reactor		handle returned by createReactor()
+//	Return Value: none
+
+void destroyReactor(REACTOR *reactor)
+{
+	ENTRY *entry;
+
+	SET_FLAG(&reactor->stop);
+	_wakeReactor(reactor);
+	pthread_join(reactor->thread, NULL);
+
+	while ((entry = reactor->pEntries))
+	{
+		reactor->pEntries = entry->pNext;
+		free(entry);
+	}
+	while ((entry = reactor->pAdded))
+	{
+		reactor->pAdded = entry->pNext;
+		free(entry);
+	}
+	pthread_cond_destroy(&reactor->removed);
+	pthread_mutex_destroy(&reactor->mutex);
+	close(reactor->evfd);
+	close(reactor->epfd);
+	free(reactor);
+}
+
+#endif		// _WIN32
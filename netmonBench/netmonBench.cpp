@@ -0,0 +1,529 @@
+//
+//	Object: netmonBench.cpp
+//	Version: 1.0
+//	Author: Gottfried Haider
+//	Last Change: 17.10.2026
+//	Developed with: GCC 12, glibc
+//
+//	Description: microbenchmarks for the protocol layer of libNokiaNetmon.
+//	They run in-process on generated byte streams (or on captures given with
+//	-f), no serial port is involved:
+//	* parse_clean, parse_noisy, parse_acks: frames through the receive parse
+//	  loop (_rxWrite()/_rxPoll() as used by _receiveFrame()), fed in chunks
+//	  like reads from the port. "noisy" has garbage, false headers and
+//	  corrupted checksums between frames, "acks" has an ACK before each frame.
+//	* build_frame: frame construction with checksums and sequence numbers
+//	* decode_cells, decode_location: page text decoding as done by
+//	  getBasestations() and getLocation()
+//
+//	Usage: netmonBench [-n frames] [-c chunk] [-f capture]... [-o file]
+//		-n frames	frames per benchmark (default 200000)
+//		-c chunk	bytes per simulated read (default 64)
+//		-f file		additional raw byte stream to parse (e.g. recorded with a
+//					serial sniffer), may be given more than once
+//		-o file		write results there instead of stdout
+//
+//	Output: one JSON object per benchmark and line, with the fields bench,
+//	frames, bytes, ns_per_frame, frames_per_s, bytes_per_s, allocs_per_frame,
+//	p50_ns and p99_ns. Percentiles are taken over batches of BATCH frames (per
+//	frame), which keeps the clock overhead out of them.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libNokiaNetmon/libNokiaNetmonInternal.h"
+
+
+//	Defines
+
+
+#define BATCH			16			// frames per latency sample
+#define STREAM_FRAMES	4096		// frames in a generated stream
+
+
+//	Allocation Counting
+
+
+// the library's heap calls are counted by interposing the allocator (glibc)
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+unsigned long g_allocs = 0;		// number of malloc/calloc/realloc calls
+
+extern "C" void *malloc(size_t size)
+{
+	g_allocs++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+	g_allocs++;
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	g_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+
+//	Structs
+
+
+typedef struct
+{
+	unsigned char	*data;
+	unsigned long	len;
+	unsigned long	size;
+} STREAM;
+
+typedef struct
+{
+	const char		*name;
+	unsigned long	frames;		// frames processed
+	unsigned long	bytes;		// bytes processed (parse benchmarks only)
+	double			ns;			// total time
+	unsigned long	allocs;		// heap calls
+	double			p50, p99;	// ns per frame
+} RESULT;
+
+typedef struct
+{
+	STREAM			*stream;
+	unsigned long	pos;		// read position in stream
+	unsigned long	bytes;		// bytes fed so far
+	unsigned long	chunk;		// bytes per simulated read
+	RXSTATE			rx;
+} PARSEBENCH;
+
+typedef struct
+{
+	char			text[4][256];	// pages as returned by _receiveFrame()
+	unsigned int	len[4];			// their lengths
+} PAGESET;
+
+
+//	Global Variables
+
+
+unsigned int	g_random = 1;		// state of _random()
+FILE			*g_out = NULL;
+
+
+//	Helper Functions
+
+
+double _now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+
+unsigned int _random(void)
+{
+	g_random = g_random*1103515245 + 12345;
+	return (g_random >> 16) & 0x7fff;
+}
+
+
+int _cmpDouble(const void *a, const void *b)
+{
+	double d = *(const double*)a - *(const double*)b;
+	return (d > 0) - (d < 0);
+}
+
+
+void _append(STREAM *s, const unsigned char *buf, unsigned long len)
+{
+	if (s->len+len > s->size)
+	{
+		s->size = (s->len+len)*2;
+		s->data = (unsigned char*)realloc(s->data, s->size);
+	}
+	memcpy(s->data+s->len, buf, len);
+	s->len += len;
+}
+
+
+//	unsigned int _phoneFrame(unsigned char *dest, unsigned char cmd, const unsigned char *payload, unsigned int len)
+//	Description: builds a frame from phone to terminal, as netmonSim does
+//	Return Value: length of the frame
+
+unsigned int _phoneFrame(unsigned char *dest, unsigned char cmd, const unsigned char *payload, unsigned int len)
+{
+	unsigned int i, n = 0;
+	unsigned char chk[2] = { 0, 0 };
+
+	dest[n++] = 0x1e;
+	dest[n++] = 0x0c;
+	dest[n++] = 0x00;
+	dest[n++] = cmd;
+	dest[n++] = 0x00;
+	dest[n++] = (unsigned char)len;
+	memcpy(dest+n, payload, len);
+	n += len;
+	if (len & 1)
+		dest[n++] = 0x00;
+	for (i=0; i<n; i++)
+		chk[i & 1] ^= dest[i];
+	dest[n++] = chk[0];
+	dest[n++] = chk[1];
+	return n;
+}
+
+
+//	unsigned int _pageText(unsigned char page, unsigned int variant, unsigned char *dest)
+//	Description: renders Netmonitor page 3-5 or 0x0b (layout see netmonSim)
+//	Return Value: length of the payload including a sequence number
+
+unsigned int _pageText(unsigned char page, unsigned int variant, unsigned char *dest)
+{
+	char line[40];
+	unsigned int i, len = 0;
+
+	dest[len++] = 0x01;
+	dest[len++] = 0x7e;
+	dest[len++] = page;
+	dest[len++] = 0x00;
+	for (i=0; i<(page == 0x0b ? 4u : 3u); i++)
+	{
+		if (page == 0x0b)
+		{
+			static const char *fmt[4] = { "CC:232NC:  5", "LAC: %4u   ", "CH: %03u     ", "%5u       " };
+			snprintf(line, sizeof(line), fmt[i], (i == 1) ? 1234+variant%7 : (i == 2) ? 62+variant%50 : 10402+variant);
+		}
+		else
+		{
+			int dbm = -60 - (int)((variant+i*7+page) % 50);
+			snprintf(line, sizeof(line), "%3u%3d%3d%3d", 10+(variant*3+i+page*5)%110, dbm+110, (dbm <= -100) ? -dbm : dbm, dbm+110);
+		}
+		memcpy(dest+len, line, 12);
+		len += 12;
+		dest[len++] = 0x00;
+	}
+	dest[len++] = 0x40 | (variant & 0x07);	// sequence number
+	return len;
+}
+
+
+//	void _makeStream(STREAM *s, int kind)
+//	Description: generates a byte stream of STREAM_FRAMES Netmonitor replies
+//	Parameters:
+//		kind		0 clean, 1 noisy, 2 with interleaved ACKs
+
+void _makeStream(STREAM *s, int kind)
+{
+	unsigned char payload[256], frame[FRAME_MAX], ack[2];
+	unsigned int i, j, len, n;
+	static const unsigned char pages[4] = { 3, 4, 5, 0x0b };
+
+	memset(s, 0, sizeof(STREAM));
+	for (i=0; i<STREAM_FRAMES; i++)
+	{
+		len = _pageText(pages[i % 4], i, payload);
+		n = _phoneFrame(frame, 0x40, payload, len);
+
+		if (kind == 1)
+		{
+			// garbage, sometimes with a false header
+			unsigned char junk[24];
+			unsigned int k = _random() % 16;
+			for (j=0; j<k; j++)
+				junk[j] = (unsigned char)_random();
+			if (_random() % 4 == 0)
+			{
+				junk[k++] = 0x1e;
+				junk[k++] = 0x0c;
+				junk[k++] = 0x00;
+				junk[k++] = 0x40;
+			}
+			_append(s, junk, k);
+
+			// corrupted frame followed by the valid retransmission
+			if (_random() % 10 == 0)
+			{
+				frame[n-1] ^= 0x5a;
+				_append(s, frame, n);
+				frame[n-1] ^= 0x5a;
+			}
+		}
+		else if (kind == 2)
+		{
+			ack[0] = 0x40;
+			ack[1] = i & 0x07;
+			unsigned char ackFrame[16];
+			_append(s, ackFrame, _phoneFrame(ackFrame, 0x7f, ack, 2));
+		}
+
+		_append(s, frame, n);
+	}
+}
+
+
+//	bool _loadStream(STREAM *s, const char *fn)
+//	Description: reads a captured byte stream
+
+bool _loadStream(STREAM *s, const char *fn)
+{
+	unsigned char buf[4096];
+	size_t n;
+	FILE *f = fopen(fn, "rb");
+
+	if (!f)
+		return false;
+	memset(s, 0, sizeof(STREAM));
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		_append(s, buf, n);
+	fclose(f);
+	return (s->len > 0);
+}
+
+
+//	void _report(RESULT *r)
+//	Description: writes a result as a line of JSON
+
+void _report(RESULT *r)
+{
+	double perFrame = r->ns / r->frames;
+
+	fprintf(g_out, "{\"bench\": \"%s\", \"frames\": %lu, \"bytes\": %lu, \"ns_per_frame\": %.2f, "
+		"\"frames_per_s\": %.0f, \"bytes_per_s\": %.0f, \"allocs_per_frame\": %.3f, "
+		"\"p50_ns\": %.2f, \"p99_ns\": %.2f}\n",
+		r->name, r->frames, r->bytes, perFrame,
+		1e9/perFrame, r->bytes ? r->bytes*1e9/r->ns : 0.0, (double)r->allocs/r->frames,
+		r->p50, r->p99);
+	fflush(g_out);
+}
+
+
+//	void _run(RESULT *r, unsigned long frames, bool (*op)(void*), void *ctx, unsigned long *bytes)
+//	Description: runs op() frames times for the totals, then once more in
+//	batches of BATCH frames for the percentiles
+//	Parameters:
+//		op			processes one frame, returns false if it cannot make progress
+//		ctx			passed to op()
+//		bytes		byte counter advanced by op(), NULL if there is none
+
+void _run(RESULT *r, unsigned long frames, bool (*op)(void*), void *ctx, unsigned long *bytes)
+{
+	unsigned long i, j, numSamples = frames/BATCH;
+	double t, *samples = (double*)__libc_malloc(numSamples*sizeof(double));
+
+	// warm up
+	for (i=0; i<frames/10; i++)
+	{
+		if (!op(ctx))
+		{
+			fprintf(stderr, "netmonBench: %s makes no progress\n", r->name);
+			r->frames = 0;
+			return;
+		}
+	}
+
+	r->allocs = g_allocs;
+	r->bytes = bytes ? *bytes : 0;
+	t = _now();
+	for (i=0; i<frames; i++)
+		op(ctx);
+	r->ns = _now() - t;
+	r->allocs = g_allocs - r->allocs;
+	r->bytes = bytes ? *bytes - r->bytes : 0;
+	r->frames = frames;
+
+	for (i=0; i<numSamples; i++)
+	{
+		t = _now();
+		for (j=0; j<BATCH; j++)
+			op(ctx);
+		samples[i] = (_now() - t) / BATCH;
+	}
+	qsort(samples, numSamples, sizeof(double), _cmpDouble);
+	r->p50 = numSamples ? samples[numSamples/2] : 0.0;
+	r->p99 = numSamples ? samples[(numSamples*99)/100] : 0.0;
+	free(samples);
+}
+
+
+//	Benchmarks
+
+
+// feeds chunks of the stream until a frame other than an ACK is complete
+bool _opParse(void *ctx)
+{
+	PARSEBENCH *b = (PARSEBENCH*)ctx;
+	unsigned long n, wraps = 0;
+
+	do
+	{
+		while (_rxPoll(&b->rx))
+		{
+			if (b->rx.cmd != 0x7f)
+				return true;
+		}
+
+		n = b->stream->len - b->pos;
+		if (n > b->chunk)
+			n = b->chunk;
+		n = _rxWrite(&b->rx, (const char*)b->stream->data+b->pos, n);
+		b->pos += n;
+		b->bytes += n;
+		if (b->pos == b->stream->len)
+		{
+			b->pos = 0;
+			if (++wraps == 2)
+				return false;		// no frames in stream
+		}
+	}
+	while (true);
+}
+
+bool _opBuild(void *ctx)
+{
+	static const char *args[4] = { "\x64\x01", "\x7e\x03", "\x7e\x04", "\x7e\x05" };
+	static unsigned int i = 0;
+	static unsigned int seq = 0x40;
+	char frame[FRAME_MAX];
+
+	_buildFrame(&seq, 0x40, args[i++ & 3], 2, frame);
+	*(volatile char*)ctx = frame[10];	// keep the frame alive
+	return true;
+}
+
+bool _opDecodeCells(void *ctx)
+{
+	PAGESET *pages = (PAGESET*)ctx;
+	static unsigned int i = 0;
+	CELL cells[MAX_BASESTATIONS];
+	unsigned int malformed, n = i++ & 3;
+
+	return (_decodeCells(pages->text[n], pages->len[n], cells, MAX_BASESTATIONS, &malformed) <= MAX_BASESTATIONS && !malformed);
+}
+
+bool _opDecodeLocation(void *ctx)
+{
+	PAGESET *pages = (PAGESET*)ctx;
+	static unsigned int i = 0;
+	LOC loc;
+	unsigned int malformed, n = i++ & 3;
+
+	return (_decodeLocation(pages->text[n], pages->len[n], &loc, &malformed) == SUCCESS);
+}
+
+
+void _benchParse(const char *name, STREAM *s, unsigned long frames, unsigned long chunk)
+{
+	static PARSEBENCH b;
+	RESULT r = { name };
+
+	memset(&b, 0, sizeof(b));
+	b.stream = s;
+	b.chunk = chunk;
+	_rxReset(&b.rx);
+
+	_run(&r, frames, _opParse, &b, &b.bytes);
+	if (r.frames)
+		_report(&r);
+}
+
+
+// renders pages as _receiveFrame() returns them (without sequence number)
+void _makePages(unsigned char page, PAGESET *dest)
+{
+	unsigned char payload[256];
+	unsigned int i;
+
+	for (i=0; i<4; i++)
+	{
+		dest->len[i] = _pageText(page, i*5, payload) - 1;
+		memcpy(dest->text[i], payload, dest->len[i]);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	STREAM streams[3], capture;
+	unsigned long frames = 200000, chunk = 64;
+	const char *captures[16];
+	unsigned int i, numCaptures = 0;
+	PAGESET cellPages, locPages;
+	char sink;
+	int opt;
+
+	g_out = stdout;
+	while ((opt = getopt(argc, argv, "n:c:f:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': frames = strtoul(optarg, NULL, 10); break;
+		case 'c': chunk = strtoul(optarg, NULL, 10); break;
+		case 'f':
+			if (numCaptures < 16)
+				captures[numCaptures++] = optarg;
+			break;
+		case 'o':
+			g_out = fopen(optarg, "w");
+			if (!g_out)
+			{
+				perror("netmonBench");
+				return 1;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n frames] [-c chunk] [-f capture]... [-o file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (frames < BATCH)
+		frames = BATCH;
+	if (chunk == 0 || chunk > RXBUF_SIZE)
+		chunk = RXBUF_SIZE;
+
+	// receive path
+	for (i=0; i<3; i++)
+		_makeStream(&streams[i], i);
+	_benchParse("parse_clean", &streams[0], frames, chunk);
+	_benchParse("parse_noisy", &streams[1], frames, chunk);
+	_benchParse("parse_acks", &streams[2], frames, chunk);
+	for (i=0; i<numCaptures; i++)
+	{
+		if (!_loadStream(&capture, captures[i]))
+		{
+			fprintf(stderr, "netmonBench: cannot read %s\n", captures[i]);
+			continue;
+		}
+		_benchParse(captures[i], &capture, frames, chunk);
+		free(capture.data);
+	}
+
+	// send path
+	RESULT build = { "build_frame" };
+	_run(&build, frames, _opBuild, &sink, NULL);
+	_report(&build);
+
+	// page decoding
+	_makePages(3, &cellPages);
+	_makePages(0x0b, &locPages);
+	RESULT cells = { "decode_cells" };
+	_run(&cells, frames, _opDecodeCells, &cellPages, NULL);
+	_report(&cells);
+	RESULT loc = { "decode_location" };
+	_run(&loc, frames, _opDecodeLocation, &locPages, NULL);
+	_report(&loc);
+
+	for (i=0; i<3; i++)
+		free(streams[i].data);
+	if (g_out != stdout)
+		fclose(g_out);
+
+	return 0;
+}
@@ -0,0 +1,644 @@
+//
+//	Object: netmonSim.cpp
+//	Version: 1.0
+//	Author: Gottfried Haider
+//	Last Change: 17.10.2026
+//	Developed with: GCC 12, Linux pseudo-terminals
+//
+//	Description: netmonSim is a stand-in for a Nokia 3310 with Netmonitor
+//	activated. It opens a pseudo-terminal and speaks the FBUS subset used by
+//	libNokiaNetmon on it: it ignores the 0x55 synchronization burst, acknowledges
+//	frames (cmd 0x7f), answers the security command (0x40 "\x64\x01") and serves
+//	the Netmonitor pages 3, 4, 5 and 0x0b in the fixed-width layout getBasestations()
+//	and getLocation() parse. The cells it reports follow a scenario, which is
+//	either built in or read from a file. Response latency, dropped frames and
+//	corrupted checksums can be configured to exercise error paths.
+//
+//	Usage: netmonSim [-l link] [-f scenario] [-d delay] [-j jitter] [-D drop%]
+//	       [-C corrupt%] [-r seed] [-a pages] [-S] [-v]
+//		-l link		create a symlink to the pty (e.g. /tmp/ttyNOKIA)
+//		-f file		scenario file (see below), default: built in walk
+//		-d ms		delay before each reply
+//		-j ms		random jitter added to the delay
+//		-D percent	probability that a reply is dropped
+//		-C percent	probability that a reply has a corrupted checksum
+//		-r seed		seed for the random number generator
+//		-a pages	Netmonitor access expires after this many pages, further page
+//					requests get an error reply until the next security command
+//		-S			advance one scenario step per page 3 request instead of by time
+//		-v			print every frame
+//
+//	Scenario files consist of steps. A step starts with "step <duration in ms>",
+//	followed by "loc <MCC> <MNC> <LAC> <cell id>" (optional, carried over from
+//	the previous step) and up to nine "cell <channel> <dBm>" lines. The first
+//	cell is the serving cell. The scenario loops. Lines starting with # are
+//	ignored.
+//
+//		step 2000
+//		loc 232 5 1234 10402
+//		cell 62 -63
+//		cell 70 -78
+//
+//	Notes: connect with connectMobileDevice(port, "<pty or link>") or with
+//	"open <port> <pty or link>" on the gsm pd object.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+//	Defines
+
+
+#define MAX_CELLS		9		// pages 3, 4 and 5 show three cells each
+#define MAX_STEPS		1024	// maximum number of scenario steps
+#define MAX_PENDING		64		// maximum number of queued outgoing frames
+#define MAX_FRAME		300		// maximum size of a frame on the wire
+
+
+//	Structs
+
+
+typedef struct
+{
+	unsigned short	channel;	// GSM channel number
+	int				dbm;		// signal strength in dBm (negative)
+} SIMCELL;
+
+typedef struct
+{
+	unsigned long	duration;	// time this step lasts in miliseconds
+	unsigned int	country;	// MCC
+	unsigned int	network;	// MNC
+	unsigned int	area;		// LAC
+	unsigned int	cell;		// cell identifier
+	unsigned int	numCells;	// number of entries in cells
+	SIMCELL			cells[MAX_CELLS];	// visible cells, serving cell first
+} SIMSTEP;
+
+typedef struct
+{
+	unsigned long	due;		// time the frame is written (in _getTicks() units)
+	unsigned int	len;		// length of data
+	unsigned char	data[MAX_FRAME];
+} PENDING;
+
+typedef struct
+{
+	int				state;		// byte position in the frame header, see _feed()
+	unsigned char	cmd;		// command
+	unsigned int	length;		// payload length
+	unsigned int	pos;		// payload bytes received
+	unsigned char	chk[2];		// running checksums of even/odd bytes
+	unsigned char	payload[256];
+} SIMRX;
+
+
+//	Global Variables
+
+
+SIMSTEP			g_steps[MAX_STEPS];		// scenario
+unsigned int	g_numSteps = 0;
+unsigned int	g_curStep = 0;
+unsigned long	g_stepStart = 0;		// time the current step began
+PENDING			g_pending[MAX_PENDING];	// frames waiting to be written, ordered by due time
+unsigned int	g_numPending = 0;
+unsigned char	g_seq = 0;				// sequence number of our frames (lower three bits)
+bool			g_access = false;		// security command received
+unsigned int	g_accessPages = 0;		// pages served since the security command
+
+unsigned long	g_delay = 0;			// -d
+unsigned long	g_jitter = 0;			// -j
+unsigned int	g_drop = 0;				// -D
+unsigned int	g_corrupt = 0;			// -C
+unsigned int	g_expire = 0;			// -a
+bool			g_perScan = false;		// -S
+bool			g_verbose = false;		// -v
+volatile bool	g_running = true;
+
+
+//	Functions
+
+
+//	unsigned long _getTicks(void)
+//	Description: returns a monotonic timestamp in miliseconds
+
+unsigned long _getTicks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)(ts.tv_sec*1000 + ts.tv_nsec/1000000);
+}
+
+
+//	void _onSignal(int sig)
+//	Description: ends the main loop on SIGINT/SIGTERM
+
+void _onSignal(int sig)
+{
+	g_running = false;
+}
+
+
+//	void _defaultScenario(void)
+//	Description: fills g_steps with a short walk between two cells
+
+void _defaultScenario(void)
+{
+	static const SIMCELL walk[4][6] =
+	{
+		{ { 62, -63 }, { 70, -78 }, { 80, -85 }, { 19, -91 }, { 25, -97 }, { 111, -104 } },
+		{ { 62, -71 }, { 70, -74 }, { 80, -88 }, { 19, -90 }, { 25, -99 }, { 111, -102 } },
+		{ { 70, -66 }, { 62, -79 }, { 19, -84 }, { 80, -93 }, { 111, -98 }, { 25, -106 } },
+		{ { 70, -61 }, { 19, -80 }, { 62, -86 }, { 111, -95 }, { 80, -97 }, { 25, -108 } }
+	};
+	unsigned int i;
+
+	for (i=0; i<4; i++)
+	{
+		g_steps[i].duration = 1500;
+		g_steps[i].country = 232;
+		g_steps[i].network = 5;
+		g_steps[i].area = (i < 2) ? 1234 : 1235;
+		g_steps[i].cell = (i < 2) ? 10402 : 10517;
+		g_steps[i].numCells = 6;
+		memcpy(g_steps[i].cells, walk[i], sizeof(walk[i]));
+	}
+	g_numSteps = 4;
+}
+
+
+//	bool _loadScenario(const char *fn)
+//	Description: reads a scenario file into g_steps (format see above)
+//	Return Value: true on success
+
+bool _loadScenario(const char *fn)
+{
+	FILE *f;
+	char line[256];
+	SIMSTEP *cur = NULL;
+	unsigned int lineNo = 0;
+	unsigned int a, b, c, d;
+	int dbm;
+
+	f = fopen(fn, "r");
+	if (!f)
+	{
+		fprintf(stderr, "netmonSim: cannot open %s\n", fn);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		lineNo++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+			continue;
+
+		if (sscanf(line, "step %u", &a) == 1)
+		{
+			if (g_numSteps == MAX_STEPS)
+				break;
+			cur = &g_steps[g_numSteps++];
+			if (g_numSteps > 1)
+				*cur = g_steps[g_numSteps-2];	// inherit location
+			cur->duration = a;
+			cur->numCells = 0;
+		}
+		else if (cur && sscanf(line, "loc %u %u %u %u", &a, &b, &c, &d) == 4)
+		{
+			cur->country = a;
+			cur->network = b;
+			cur->area = c;
+			cur->cell = d;
+		}
+		else if (cur && sscanf(line, "cell %u %d", &a, &dbm) == 2)
+		{
+			if (cur->numCells < MAX_CELLS)
+			{
+				cur->cells[cur->numCells].channel = (unsigned short)a;
+				cur->cells[cur->numCells].dbm = dbm;
+				cur->numCells++;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "netmonSim: %s:%u: cannot parse line\n", fn, lineNo);
+			fclose(f);
+			return false;
+		}
+	}
+	fclose(f);
+
+	if (g_numSteps == 0)
+	{
+		fprintf(stderr, "netmonSim: %s contains no steps\n", fn);
+		return false;
+	}
+	return true;
+}
+
+
+//	SIMSTEP *_curStep(void)
+//	Description: returns the current scenario step, advancing it by time
+//	unless -S was given
+
+SIMSTEP *_curStep(void)
+{
+	unsigned long now = _getTicks();
+
+	if (!g_perScan)
+	{
+		while (now - g_stepStart >= g_steps[g_curStep].duration && g_steps[g_curStep].duration)
+		{
+			g_stepStart += g_steps[g_curStep].duration;
+			g_curStep = (g_curStep+1) % g_numSteps;
+		}
+	}
+	return &g_steps[g_curStep];
+}
+
+
+//	void _queueFrame(unsigned char cmd, const unsigned char *payload, unsigned int len, unsigned long delay, bool corrupt)
+//	Description: builds a frame from phone to terminal and queues it for writing
+//	Parameters:
+//		cmd			command
+//		payload		payload including the sequence number
+//		len			length of payload
+//		delay		miliseconds to wait before writing the frame
+//		corrupt		true to invert the odd checksum
+
+void _queueFrame(unsigned char cmd, const unsigned char *payload, unsigned int len, unsigned long delay, bool corrupt)
+{
+	PENDING *p;
+	unsigned int i, n = 0;
+	unsigned char chk[2] = { 0, 0 };
+
+	if (g_numPending == MAX_PENDING || len > 255)
+		return;		// terminal is not reading, drop
+
+	// keep the queue ordered by due time
+	i = g_numPending;
+	while (i > 0 && g_pending[i-1].due > _getTicks()+delay)
+	{
+		g_pending[i] = g_pending[i-1];
+		i--;
+	}
+	p = &g_pending[i];
+	g_numPending++;
+
+	p->due = _getTicks() + delay;
+	p->data[n++] = 0x1e;	// FBUS frame id (cable)
+	p->data[n++] = 0x0c;	// destination (terminal)
+	p->data[n++] = 0x00;	// sender (phone)
+	p->data[n++] = cmd;
+	p->data[n++] = 0x00;	// MSB of payload length
+	p->data[n++] = (unsigned char)len;
+	memcpy(p->data+n, payload, len);
+	n += len;
+	if (len & 1)
+		p->data[n++] = 0x00;	// padding byte
+	for (i=0; i<n; i++)
+		chk[i & 1] ^= p->data[i];
+	p->data[n++] = chk[0];
+	p->data[n++] = chk[1] ^ (corrupt ? 0xff : 0x00);
+	p->len = n;
+}
+
+
+//	void _appendLine(unsigned char *dest, unsigned int *len, const char *text)
+//	Description: appends a 12 character display line and its 0x00 terminator
+
+void _appendLine(unsigned char *dest, unsigned int *len, const char *text)
+{
+	memcpy(dest+*len, text, 12);
+	*len += 12;
+	dest[(*len)++] = 0x00;
+}
+
+
+//	unsigned int _buildPage(unsigned char page, unsigned char *dest)
+//	Description: renders a Netmonitor page as returned by the phone
+//	Parameters:
+//		page		page number (3, 4, 5 or 0x0b)
+//		dest		payload buffer (without sequence number)
+//	Return Value: length of the payload
+//	Notes: The payload starts with 4 bytes (0x01 0x7e page 0x00), followed by
+//	12 character lines terminated by 0x00. On pages 3-5 each line shows one
+//	cell: channel (cols 0-2), C1 (3-5), dBm (6-8, "105" for -105) and C2 (9-11).
+//	Page 0x0b shows "CC:<MCC>NC:<MNC>", "LAC:<LAC>", "CH: <channel>" and the
+//	cell identifier, right-aligned where getLocation() expects them.
+
+unsigned int _buildPage(unsigned char page, unsigned char *dest)
+{
+	SIMSTEP *step = _curStep();
+	char line[40];		// 12 characters are used
+	unsigned int i, len = 0;
+
+	dest[len++] = 0x01;
+	dest[len++] = 0x7e;
+	dest[len++] = page;
+	dest[len++] = 0x00;
+
+	if (page >= 3 && page <= 5)
+	{
+		for (i=(page-3)*3u; i<(page-3)*3u+3; i++)
+		{
+			if (i < step->numCells)
+			{
+				int dbm = step->cells[i].dbm;
+				int c1 = dbm + 110;		// rough C1/C2 path loss criteria
+				if (dbm <= -100)
+					snprintf(line, sizeof(line), "%3u%3d%3d%3d", step->cells[i].channel, c1, -dbm, c1);
+				else
+					snprintf(line, sizeof(line), "%3u%3d%3d%3d", step->cells[i].channel, c1, dbm, c1);
+			}
+			else
+				snprintf(line, sizeof(line), "xxxxxxxxxxxx");
+			_appendLine(dest, &len, line);
+		}
+	}
+	else if (page == 0x0b)
+	{
+		snprintf(line, sizeof(line), "CC:%03uNC:%3u", step->country % 1000, step->network % 1000);
+		_appendLine(dest, &len, line);
+		snprintf(line, sizeof(line), "LAC:%5u   ", step->area % 100000);
+		_appendLine(dest, &len, line);
+		snprintf(line, sizeof(line), "CH: %03u     ", step->numCells ? step->cells[0].channel % 1000 : 0);
+		_appendLine(dest, &len, line);
+		snprintf(line, sizeof(line), "%5u       ", step->cell % 100000);
+		_appendLine(dest, &len, line);
+	}
+	else
+	{
+		snprintf(line, sizeof(line), "            ");	// pages we don't simulate are blank
+		_appendLine(dest, &len, line);
+	}
+
+	return len;
+}
+
+
+//	void _handleFrame(SIMRX *rx)
+//	Description: acknowledges a frame from the terminal and queues the reply
+
+void _handleFrame(SIMRX *rx)
+{
+	unsigned char reply[256];
+	unsigned char ack[2];
+	unsigned int len = 0;
+	unsigned long delay;
+	unsigned char seq = rx->payload[rx->length-1];
+
+	if (g_verbose)
+	{
+		printf("netmonSim: <- cmd %02x len %u:", rx->cmd, rx->length);
+		for (unsigned int i=0; i<rx->length; i++)
+			printf(" %02x", rx->payload[i]);
+		printf("\n");
+	}
+
+	if (rx->cmd == 0x7f)
+		return;		// ACK from terminal
+
+	// acknowledge right away
+	ack[0] = rx->cmd;
+	ack[1] = seq & 0x07;
+	_queueFrame(0x7f, ack, 2, 0, false);
+
+	if (rx->cmd != 0x40 || rx->length < 4)
+		return;		// nothing else is supported
+
+	// payload from terminal: 0x00 0x01 <args> 0x01 <seq>
+	if (rx->payload[2] == 0x64)
+	{
+		// security command
+		g_access = true;
+		g_accessPages = 0;
+		reply[len++] = 0x01;
+		reply[len++] = 0x64;
+		reply[len++] = 0x01;
+		reply[len++] = 0x00;
+	}
+	else if (rx->payload[2] == 0x7e && g_expire && (!g_access || g_accessPages >= g_expire))
+	{
+		// access expired (or never granted)
+		g_access = false;
+		reply[len++] = 0x01;
+		reply[len++] = 0xff;
+		reply[len++] = 0x00;
+	}
+	else if (rx->payload[2] == 0x7e)
+	{
+		g_accessPages++;
+		if (g_perScan && rx->payload[3] == 3)
+		{
+			g_curStep = (g_curStep+1) % g_numSteps;
+		}
+		len = _buildPage(rx->payload[3], reply);
+	}
+	else
+		return;
+
+	if (g_drop && (unsigned int)(rand() % 100) < g_drop)
+	{
+		if (g_verbose)
+			printf("netmonSim: dropping reply\n");
+		return;
+	}
+
+	reply[len++] = 0x40 | (g_seq++ & 0x07);		// our sequence number
+	delay = g_delay + (g_jitter ? (unsigned long)(rand() % (g_jitter+1)) : 0);
+	_queueFrame(0x40, reply, len, delay, g_corrupt && (unsigned int)(rand() % 100) < g_corrupt);
+}
+
+
+//	void _feed(SIMRX *rx, unsigned char c)
+//	Description: parses frames from terminal to phone byte by byte and calls
+//	_handleFrame() for each frame with valid checksums
+
+void _feed(SIMRX *rx, unsigned char c)
+{
+	static const unsigned char header[3] = { 0x1e, 0x00, 0x0c };	// frame id, destination (phone), sender (terminal)
+
+	if (rx->state < 3)
+	{
+		if (c == header[rx->state])
+		{
+			if (rx->state == 0)
+				rx->chk[0] = rx->chk[1] = 0x00;
+			rx->chk[rx->state & 1] ^= c;
+			rx->state++;
+		}
+		else if (c == 0x1e)
+		{
+			rx->chk[0] = c;		// might be the start of the next frame
+			rx->chk[1] = 0x00;
+			rx->state = 1;
+		}
+		else
+			rx->state = 0;		// 0x55 bytes of the init string end up here
+		return;
+	}
+
+	switch (rx->state)
+	{
+	case 3:		// command
+		rx->cmd = c;
+		rx->chk[1] ^= c;
+		rx->state++;
+		break;
+	case 4:		// MSB of length
+		rx->chk[0] ^= c;
+		rx->state = (c == 0) ? 5 : 0;
+		break;
+	case 5:		// length
+		rx->chk[1] ^= c;
+		rx->length = c;
+		rx->pos = 0;
+		rx->state = c ? 6 : 0;
+		break;
+	case 6:		// payload
+		rx->chk[rx->pos & 1] ^= c;
+		rx->payload[rx->pos++] = c;
+		if (rx->pos == rx->length)
+			rx->state = (rx->length & 1) ? 7 : 8;
+		break;
+	case 7:		// padding
+		rx->chk[1] ^= c;
+		rx->state = 8;
+		break;
+	case 8:		// even checksum
+		rx->state = (c == rx->chk[0]) ? 9 : 0;
+		if (!rx->state && g_verbose)
+			printf("netmonSim: checksum error\n");
+		break;
+	case 9:		// odd checksum
+		rx->state = 0;
+		if (c == rx->chk[1])
+			_handleFrame(rx);
+		else if (g_verbose)
+			printf("netmonSim: checksum error\n");
+		break;
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	SIMRX rx;
+	struct pollfd pfd;
+	struct termios tio;
+	const char *link = NULL, *scenario = NULL;
+	unsigned char buf[512];
+	int master, slave, opt, timeout;
+	ssize_t n;
+
+	srand(1);
+	while ((opt = getopt(argc, argv, "l:f:d:j:D:C:r:a:Sv")) != -1)
+	{
+		switch (opt)
+		{
+		case 'l': link = optarg; break;
+		case 'f': scenario = optarg; break;
+		case 'd': g_delay = strtoul(optarg, NULL, 10); break;
+		case 'j': g_jitter = strtoul(optarg, NULL, 10); break;
+		case 'D': g_drop = atoi(optarg); break;
+		case 'C': g_corrupt = atoi(optarg); break;
+		case 'r': srand(atoi(optarg)); break;
+		case 'a': g_expire = atoi(optarg); break;
+		case 'S': g_perScan = true; break;
+		case 'v': g_verbose = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-l link] [-f scenario] [-d delay] [-j jitter] [-D drop%%] [-C corrupt%%] [-r seed] [-a pages] [-S] [-v]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (scenario)
+	{
+		if (!_loadScenario(scenario))
+			return 1;
+	}
+	else
+		_defaultScenario();
+
+	// create pty
+	master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+	{
+		perror("netmonSim: posix_openpt");
+		return 1;
+	}
+	// keep the slave open ourselves, so the master doesn't see a hangup
+	// while no terminal is connected, and put it in raw mode
+	slave = open(ptsname(master), O_RDWR|O_NOCTTY);
+	if (slave == -1 || tcgetattr(slave, &tio) == -1)
+	{
+		perror("netmonSim: slave");
+		return 1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (link)
+	{
+		unlink(link);
+		if (symlink(ptsname(master), link) == -1)
+		{
+			perror("netmonSim: symlink");
+			return 1;
+		}
+	}
+	printf("netmonSim: listening on %s\n", link ? link : ptsname(master));
+	fflush(stdout);
+
+	signal(SIGINT, _onSignal);
+	signal(SIGTERM, _onSignal);
+
+	memset(&rx, 0, sizeof(rx));
+	g_stepStart = _getTicks();
+	pfd.fd = master;
+	pfd.events = POLLIN;
+
+	while (g_running)
+	{
+		// write frames which are due
+		while (g_numPending && (long)(g_pending[0].due - _getTicks()) <= 0)
+		{
+			if (write(master, g_pending[0].data, g_pending[0].len) == -1 && errno != EINTR)
+				perror("netmonSim: write");
+			g_numPending--;
+			memmove(g_pending, g_pending+1, g_numPending*sizeof(PENDING));
+		}
+
+		timeout = -1;
+		if (g_numPending)
+		{
+			long wait = (long)(g_pending[0].due - _getTicks());
+			timeout = (wait > 0) ? (int)wait : 0;
+		}
+
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		n = read(master, buf, sizeof(buf));
+		for (ssize_t i=0; i<n; i++)
+			_feed(&rx, buf[i]);
+	}
+
+	if (link)
+		unlink(link);
+	close(slave);
+	close(master);
+
+	return 0;
+}
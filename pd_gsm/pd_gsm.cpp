@@ -12,84 +12,315 @@
 //	http://iem.at/pd/externals-HOWTO/HOWTO-externals-en.html
 //
 
-#include <windows.h>
-// DEBUG
-//#include <stdio.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "pd_gsm.h"
 
-#define		MUTEX_TIMEOUT		100L		// time we wait for a mutex before aborting
 
-
-BASE			g_baseBuf = { 0 };
-BASE			*g_pBase = &g_baseBuf;
-HANDLE			g_hMutex = 0;
-HANDLE			g_hThread = 0;
-LOC				g_locBuf = { 0 };
-NMTHREAD		g_thread = { 0 };
+NMDEVICE		*g_devices = NULL;		// all phones referenced so far
+bool			g_ptWarned = false;		// the obsolete third inlet of gsm_avg has been used
+#ifndef _WIN32
+REACTOR			*g_reactor = NULL;		// scans all phones in reactor mode, created when first needed
+#endif
 
 
 EXP void gsm_setup(void)
 {
 	// add gsm "class"
-	c_gsm = class_new(gensym("gsm"), (t_newmethod)gsm_new, (t_method)gsm_close, sizeof(t_gsm), CLASS_DEFAULT, A_NULL);
+	c_gsm = class_new(gensym("gsm"), (t_newmethod)gsm_new, (t_method)gsm_free, sizeof(t_gsm), CLASS_DEFAULT, A_DEFSYM, A_NULL);
 	class_addmethod(c_gsm, (t_method)gsm_close, gensym("close"), A_NULL);
-	class_addmethod(c_gsm, (t_method)gsm_open, gensym("open"), A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_open, gensym("open"), A_GIMME, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_pipeline, gensym("pipeline"), A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_timeout, gensym("timeout"), A_FLOAT, A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_page, gensym("page"), A_FLOAT, A_FLOAT, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_autopage, gensym("autopage"), A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_reactor, gensym("reactor"), A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_record, gensym("record"), A_DEFSYM, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_replay, gensym("replay"), A_GIMME, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_trace, gensym("trace"), A_GIMME, A_NULL);
+	class_addmethod(c_gsm, (t_method)gsm_filter, gensym("filter"), A_DEFFLOAT, A_DEFFLOAT, A_DEFFLOAT, A_NULL);
 
 	// add gsm_avg class
-	c_gsm_avg = class_new(gensym("gsm_avg"), (t_newmethod)gsm_avg_new, 0, sizeof(t_gsm_avg), CLASS_DEFAULT, A_NULL);
+	c_gsm_avg = class_new(gensym("gsm_avg"), (t_newmethod)gsm_avg_new, (t_method)gsm_obj_free, sizeof(t_gsm_avg), CLASS_DEFAULT, A_DEFSYM, A_NULL);
 	class_addbang(c_gsm_avg, gsm_avg_bang);
+	class_addmethod(c_gsm_avg, (t_method)gsm_obj_auto, gensym("auto"), A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm_avg, (t_method)gsm_avg_ema, gensym("ema"), A_NULL);
+	class_addmethod(c_gsm_avg, (t_method)gsm_avg_median, gensym("median"), A_NULL);
+	class_addmethod(c_gsm_avg, (t_method)gsm_avg_kalman, gensym("kalman"), A_NULL);
+	class_addmethod(c_gsm_avg, (t_method)gsm_avg_pt, gensym("pt"), A_FLOAT, A_NULL);
 
 	// add gsm_chan class
-	c_gsm_chan = class_new(gensym("gsm_chan"), (t_newmethod)gsm_chan_new, 0, sizeof(t_gsm_chan), CLASS_DEFAULT, A_NULL);
+	c_gsm_chan = class_new(gensym("gsm_chan"), (t_newmethod)gsm_chan_new, (t_method)gsm_obj_free, sizeof(t_gsm_chan), CLASS_DEFAULT, A_DEFSYM, A_NULL);
 	class_addbang(c_gsm_chan, gsm_chan_bang);
+	class_addmethod(c_gsm_chan, (t_method)gsm_obj_auto, gensym("auto"), A_DEFFLOAT, A_NULL);
 
 	// add gsm_loc class
-	c_gsm_loc = class_new(gensym("gsm_loc"), (t_newmethod)gsm_loc_new, 0, sizeof(t_gsm_loc), CLASS_DEFAULT, A_NULL);
+	c_gsm_loc = class_new(gensym("gsm_loc"), (t_newmethod)gsm_loc_new, (t_method)gsm_obj_free, sizeof(t_gsm_loc), CLASS_DEFAULT, A_DEFSYM, A_NULL);
 	class_addbang(c_gsm_loc, gsm_loc_bang);
+	class_addmethod(c_gsm_loc, (t_method)gsm_obj_auto, gensym("auto"), A_DEFFLOAT, A_NULL);
 
 	// add gsm_loc class
-	c_gsm_num = class_new(gensym("gsm_num"), (t_newmethod)gsm_num_new, 0, sizeof(t_gsm_num), CLASS_DEFAULT, A_NULL);
+	c_gsm_num = class_new(gensym("gsm_num"), (t_newmethod)gsm_num_new, (t_method)gsm_obj_free, sizeof(t_gsm_num), CLASS_DEFAULT, A_DEFSYM, A_NULL);
 	class_addbang(c_gsm_num, gsm_num_bang);
+	class_addmethod(c_gsm_num, (t_method)gsm_obj_auto, gensym("auto"), A_DEFFLOAT, A_NULL);
 
 	// add gsm_sort class
-	c_gsm_sort = class_new(gensym("gsm_sort"), (t_newmethod)gsm_sort_new, 0, sizeof(t_gsm_sort), CLASS_DEFAULT, A_NULL);
+	c_gsm_sort = class_new(gensym("gsm_sort"), (t_newmethod)gsm_sort_new, (t_method)gsm_obj_free, sizeof(t_gsm_sort), CLASS_DEFAULT, A_DEFSYM, A_NULL);
 	class_addbang(c_gsm_sort, gsm_sort_bang);
+	class_addmethod(c_gsm_sort, (t_method)gsm_obj_auto, gensym("auto"), A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm_sort, (t_method)gsm_sort_top, gensym("top"), A_DEFFLOAT, A_NULL);
+
+	// add gsm_tab class
+	c_gsm_tab = class_new(gensym("gsm_tab"), (t_newmethod)gsm_tab_new, (t_method)gsm_obj_free, sizeof(t_gsm_tab), CLASS_DEFAULT, A_GIMME, A_NULL);
+	class_addbang(c_gsm_tab, gsm_tab_bang);
+	class_addmethod(c_gsm_tab, (t_method)gsm_obj_auto, gensym("auto"), A_DEFFLOAT, A_NULL);
+	class_addmethod(c_gsm_tab, (t_method)gsm_tab_set, gensym("set"), A_SYMBOL, A_NULL);
 
-	// create mutex protecting g_pBase
-	g_hMutex = CreateMutex(NULL, false, NULL);
+	// add gsm_stats class
+	c_gsm_stats = class_new(gensym("gsm_stats"), (t_newmethod)gsm_stats_new, 0, sizeof(t_gsm_stats), CLASS_DEFAULT, A_DEFSYM, A_NULL);
+	class_addbang(c_gsm_stats, gsm_stats_bang);
+
+	// add gsm~ class
+	c_gsm_tilde = class_new(gensym("gsm~"), (t_newmethod)gsm_tilde_new, (t_method)gsm_tilde_free, sizeof(t_gsm_tilde), CLASS_DEFAULT, A_GIMME, A_NULL);
+	class_addmethod(c_gsm_tilde, (t_method)gsm_tilde_chan, gensym("chan"), A_FLOAT, A_FLOAT, A_NULL);
+	class_addmethod(c_gsm_tilde, (t_method)gsm_tilde_rank, gensym("rank"), A_FLOAT, A_FLOAT, A_NULL);
+	class_addmethod(c_gsm_tilde, (t_method)gsm_tilde_dsp, gensym("dsp"), A_NULL);
 
 	// display version info
 	post("gsm: version 1.0 by gottfried haider");
 }
 
 
-void *gsm_new(void)
+void *gsm_new(t_symbol *name)
 {
 	t_gsm *x = (t_gsm*)pd_new(c_gsm);
+
+	x->dev = _getDevice(name);		// argument: name of the phone (optional)
 	return (void*)x;
 }
 
+void gsm_free(t_gsm *x)
+{
+	if (x->dev->owner == x)
+		gsm_close(x);		// other objects may just set options of a phone opened elsewhere
+	gsm_record(x, &s_);		// stop recording
+}
 void gsm_close(t_gsm *x)
 {
-	_stopNetmonThread();
+	_stopNetmonThread(x->dev);
+	x->dev->owner = NULL;
 }
 
-void gsm_open(t_gsm *x, t_floatarg f)
+void gsm_open(t_gsm *x, t_symbol *s, int argc, t_atom *argv)
 {
-	if (!_getNetmonState())		// only accept this message when there is no thread running
+	unsigned int	port = (unsigned int)atom_getfloatarg(0, argc, argv);
+	t_symbol		*device = atom_getsymbolarg(1, argc, argv);		// optional, e.g. "open 1 /dev/ttyUSB0"
+
+	if (!_getNetmonState(x->dev))		// only accept this message when there is no thread running
 	{
-		if (!_startNetmonThread((unsigned int)f))
+		if (x->dev->reactor)
+		{
+			if (!_startNetmonReactor(x->dev, port, (*device->s_name) ? device->s_name : NULL))
+				post("gsm: could not add phone to reactor");
+			else
+				x->dev->owner = x;
+		}
+		else if (!_startNetmonThread(x->dev, port, (*device->s_name) ? device->s_name : NULL))
 			post("gsm: could not create thread");
+		else
+			x->dev->owner = x;
+	}
+}
+
+void gsm_pipeline(t_gsm *x, t_floatarg f)
+{
+	ATOMIC_STORE(&x->dev->thread.pipeline, f != 0.0);		// picked up by the running thread before its next scan
+}
+void gsm_timeout(t_gsm *x, t_floatarg request, t_floatarg scan)
+{
+	// "timeout <miliseconds per request> [miliseconds per scan]": 0 adapts the
+	// timeout of requests to the round trip time, a scan of 0 is not limited
+	ATOMIC_STORE(&x->dev->thread.timeout, (request > 0) ? (unsigned int)request : 0);
+	ATOMIC_STORE(&x->dev->thread.budget, (scan > 0) ? (unsigned int)scan : 0);
+}
+void gsm_page(t_gsm *x, t_floatarg page, t_floatarg interval)
+{
+	unsigned int	i;
+
+	// "page <number> <miliseconds>": request a page at most this often, 0 for every
+	// scan, negative for never (page 11 is then still requested when the serving cell changes)
+	switch ((int)page)
+	{
+	case 3:
+	case 4:
+	case 5:
+		i = (unsigned int)page - 3;
+		break;
+	case 11:
+		i = 3;
+		break;
+	default:
+		post("gsm: page %d is not scanned, use 3, 4, 5 or 11", (int)page);
+		return;
+	}
+	ATOMIC_STORE(&x->dev->thread.interval[i], (interval < 0) ? -1 : (int)interval);
+}
+void gsm_autopage(t_gsm *x, t_floatarg f)
+{
+	ATOMIC_STORE(&x->dev->thread.autoPages, f != 0.0);		// picked up by the running thread before its next scan
+}
+void gsm_reactor(t_gsm *x, t_floatarg f)
+{
+#ifdef _WIN32
+	post("gsm: reactor not available on this platform");
+#else
+	x->dev->reactor = (f != 0.0);		// used by the next "open"
+#endif
+}
+void gsm_filter(t_gsm *x, t_floatarg tau, t_floatarg q, t_floatarg r)
+{
+	// "filter <time constant> [process noise] [measurement noise]", picked up with the next scan
+	if (tau > 0.0)
+		ATOMIC_STORE(&x->dev->thread.tau, tau);
+	if (q > 0.0)
+		ATOMIC_STORE(&x->dev->thread.q, q);
+	if (r > 0.0)
+		ATOMIC_STORE(&x->dev->thread.r, r);
+}
+void gsm_record(t_gsm *x, t_symbol *file)
+{
+	NMDEVICE		*dev = x->dev;
+	SCANLOG			*log;
+
+	// "record <file>" starts recording all scans of this phone, "record" stops
+	_stopLog(dev);
+	if (!*file->s_name)
+		return;
+	if (createLog(file->s_name, &log) != SUCCESS)
+	{
+		post("gsm: could not create %s", file->s_name);
+		return;
+	}
+	ATOMIC_STORE(&dev->thread.log, log);		// the thread appends every scan it publishes from now on
+}
+void gsm_replay(t_gsm *x, t_symbol *s, int argc, t_atom *argv)
+{
+	t_symbol		*file = atom_getsymbolarg(0, argc, argv);
+	float			speed = (argc > 1) ? atom_getfloatarg(1, argc, argv) : 1;	// optional, 0 for as fast as possible
+	float			start = atom_getfloatarg(2, argc, argv);				// optional, seconds into the log
+	SCANLOG			*log;
+	unsigned long long	time;
+	unsigned int	num;
+	CELL			cells[MAX_BASESTATIONS];
+	LOC				loc;
+
+	// "replay <file> [speed] [start]" feeds a recorded walk instead of a phone
+	if (_getNetmonState(x->dev))
+		return;		// only accept this message when there is no thread running
+	if (openLog(file->s_name, &log) != SUCCESS)
+	{
+		post("gsm: could not open %s", file->s_name);
+		return;
+	}
+	if (readLog(log, 0, &time, cells, &num, &loc) != SUCCESS)
+	{
+		closeLog(log);
+		post("gsm: %s is empty", file->s_name);
+		return;
+	}
+	if (speed < 0)
+		speed = 0;
+	if (start < 0)
+		start = 0;
+	if (!_startReplayThread(x->dev, log, speed, seekLog(log, time + (unsigned long long)(start*1000000.0))))
+	{
+		closeLog(log);
+		post("gsm: could not create thread");
+	}
+	else
+		x->dev->owner = x;
+}
+void gsm_trace(t_gsm *x, t_symbol *s, int argc, t_atom *argv)
+{
+	NMDEVICE		*dev = x->dev;
+	t_symbol		*file;
+
+	// "trace dump <file>" writes the events recorded so far as Chrome trace (JSON)
+	if (atom_getsymbolarg(0, argc, argv) == gensym("dump"))
+	{
+		file = atom_getsymbolarg(1, argc, argv);
+		if (!dev->traceBuf)
+			post("gsm: nothing traced yet, use \"trace 1\"");
+		else if (!_traceDump(dev->traceBuf, file->s_name, dev->name->s_name))
+			post("gsm: could not write %s", file->s_name);
+		return;
+	}
+
+	// "trace 1" starts recording events, "trace 0" stops, picked up with the next scan
+	if (atom_getfloatarg(0, argc, argv) != 0)
+	{
+		if (!dev->traceBuf)
+			dev->traceBuf = (TRACE*)getzbytes(sizeof(TRACE));
+		ATOMIC_STORE(&dev->thread.trace, dev->traceBuf);		// zeroed before the thread sees it
+	}
+	else
+		ATOMIC_STORE(&dev->thread.trace, (TRACE*)NULL);		// the buffer is kept, the thread may still be writing
+}
+
+void gsm_obj_auto(t_gsm_obj *x, t_floatarg f)
+{
+	NMDEVICE		*dev = x->dev;
+	bool			loc = (pd_class(&x->x_obj.ob_pd) == c_gsm_loc);
+
+	if ((f != 0.0) == x->automode)
+		return;
+	x->automode = (f != 0.0);
+
+	// "auto 1": bang me whenever a new scan arrives
+	if (x->automode)
+	{
+		pd_bind(&x->x_obj.ob_pd, dev->scan);
+		if (loc)
+			dev->numAutoLoc++;
+		dev->numAuto++;
 	}
+	else
+	{
+		pd_unbind(&x->x_obj.ob_pd, dev->scan);
+		if (loc)
+			dev->numAutoLoc--;
+		dev->numAuto--;
+	}
+
+	// objects in auto mode only read when a scan arrives, so the thread keeps
+	// requesting their pages, or scanning would stop for good once a timeout
+	// outlasts DEMAND_TIMEOUT
+	ATOMIC_STORE(&dev->thread.autoDemand, ((dev->numAuto > dev->numAutoLoc) ? PAGES_CELLS : 0) | (dev->numAutoLoc ? PAGE_0B : 0));
 }
 
-void *gsm_avg_new(void)
+void gsm_obj_free(t_gsm_obj *x)
+{
+	gsm_obj_auto(x, 0.0);
+	_traceForget(x->dev, &x->x_obj);
+}
+
+void *gsm_avg_new(t_symbol *name)
 {
 	t_gsm_avg *x = (t_gsm_avg*)pd_new(c_gsm_avg);
+
+	x->dev = _getDevice(name);				// argument: name of the phone (optional)
 	
+	x->filter = FILTER_EMA;					// "ema", "median" or "kalman" select the filter
 	floatinlet_new(&x->x_obj, &x->chan);		// second inlet: channel number
-	//x->pt = 3.0;								// (default: 3)
-	floatinlet_new(&x->x_obj, &x->pt);			// third inlet: n-point average
+	inlet_new(&x->x_obj, &x->x_obj.ob_pd, gensym("float"), gensym("pt"));	// third inlet: obsolete, see gsm_avg_pt()
 	outlet_new(&x->x_obj, gensym("float"));		// outlet: average power
 
 	return (void*)x;
@@ -97,36 +328,60 @@ void *gsm_avg_new(void)
 
 void gsm_avg_bang(t_gsm_avg *x)
 {
-	BASE			*base;
-	float			p = 0.0;
+	const SNAPSHOT	*snap = _getSnapshot(x->dev, PAGES_CELLS, &x->x_obj);
+	float			avg = 0.0;
 	unsigned int	chan = (unsigned int)x->chan;
 
-	// search for channel
-	base = _getBase();		// lock
-	while (base)
+	// the filters are run by the thread on every scan, so this is just a lookup
+	if (chan <= MAX_CHANNEL)
 	{
-		if (base->channel == chan)
+		switch (x->filter)
 		{
-			p = (float)base->p;
+		case FILTER_EMA:
+			avg = snap->ema[chan];
+			break;
+		case FILTER_MEDIAN:
+			avg = snap->median[chan];
+			break;
+		case FILTER_KALMAN:
+			avg = snap->kalman[chan];
 			break;
 		}
-		base = base->pNext;
 	}
-	_baseUnlock();			// unlock
 
-	if (x->pt == 0.0)
-		x->avg = 0.0;
-	else if (x->avg == 0.0)
-		x->avg = p;
-	else
-		x->avg = (x->avg * ((x->pt-(float)1.0)/(x->pt))) + (p * ((float)1.0/x->pt));
+	outlet_float(x->x_obj.ob_outlet, avg);
+}
 
-	outlet_float(x->x_obj.ob_outlet, x->avg);
+void gsm_avg_ema(t_gsm_avg *x)
+{
+	x->filter = FILTER_EMA;
+}
+
+void gsm_avg_median(t_gsm_avg *x)
+{
+	x->filter = FILTER_MEDIAN;
+}
+
+void gsm_avg_kalman(t_gsm_avg *x)
+{
+	x->filter = FILTER_KALMAN;
+}
+
+void gsm_avg_pt(t_gsm_avg *x, t_floatarg f)
+{
+	// the n-point average of each object has been replaced by the filters of the thread
+	if (f != 0.0 && !g_ptWarned)
+	{
+		post("gsm_avg: the third inlet (n-point average) is obsolete and ignored, use \"filter <time constant>\" on gsm instead");
+		g_ptWarned = true;
+	}
 }
 
-void *gsm_chan_new(void)
+void *gsm_chan_new(t_symbol *name)
 {
 	t_gsm_chan *x = (t_gsm_chan*)pd_new(c_gsm_chan);
+
+	x->dev = _getDevice(name);				// argument: name of the phone (optional)
 	
 	floatinlet_new(&x->x_obj, &x->chan);		// second inlet: channel number
 	outlet_new(&x->x_obj, gensym("float"));		// outlet: power
@@ -136,29 +391,22 @@ void *gsm_chan_new(void)
 
 void gsm_chan_bang(t_gsm_chan *x)
 {
-	BASE			*base;
+	const SNAPSHOT	*snap = _getSnapshot(x->dev, PAGES_CELLS, &x->x_obj);
 	float			p = 0.0;
 	unsigned int	chan = (unsigned int)x->chan;
 
-	// search for channel
-	base = _getBase();		// lock
-	while (base)
-	{
-		if (base->channel == chan)
-		{
-			p = (float)base->p;
-			break;
-		}
-		base = base->pNext;
-	}
-	_baseUnlock();			// unlock
+	// look up channel
+	if (chan <= MAX_CHANNEL && snap->channels[chan].present)
+		p = (float)snap->channels[chan].p;
 
 	outlet_float(x->x_obj.ob_outlet, p);
 }
 
-void *gsm_loc_new(void)
+void *gsm_loc_new(t_symbol *name)
 {
 	t_gsm_loc *x = (t_gsm_loc*)pd_new(c_gsm_loc);
+
+	x->dev = _getDevice(name);				// argument: name of the phone (optional)
 	x->country_out = outlet_new(&x->x_obj, gensym("float"));	// first outlet: Mobile Country Code (MCC, Austria is 232)
 	x->network_out = outlet_new(&x->x_obj, gensym("float"));	// second outlet: Mobile Network Code (MNC, yesss! is 5 in Austria)
 	x->area_out = outlet_new(&x->x_obj, gensym("float"));		// third outlet: Location Area {Identifier,Code} (LAI/LAC)
@@ -169,284 +417,1269 @@ void *gsm_loc_new(void)
 
 void gsm_loc_bang(t_gsm_loc *x)
 {
-	outlet_float(x->country_out, (float)g_locBuf.country);
-	outlet_float(x->network_out, (float)g_locBuf.network);
-	outlet_float(x->area_out, (float)g_locBuf.area);
-	outlet_float(x->cell_out, (float)g_locBuf.cell);
+	const LOC		*loc = &_getSnapshot(x->dev, PAGE_0B, &x->x_obj)->loc;
+
+	outlet_float(x->country_out, (float)loc->country);
+	outlet_float(x->network_out, (float)loc->network);
+	outlet_float(x->area_out, (float)loc->area);
+	outlet_float(x->cell_out, (float)loc->cell);
 }
 
-void *gsm_num_new(void)
+void *gsm_num_new(t_symbol *name)
 {
 	t_gsm_num *x = (t_gsm_num*)pd_new(c_gsm_num);
+
+	x->dev = _getDevice(name);				// argument: name of the phone (optional)
 	
 	outlet_new(&x->x_obj, gensym("float"));		// outlet: number of channels
+	x->partial_out = outlet_new(&x->x_obj, gensym("float"));	// outlet: 1 if the scan is partial
 
 	return (void*)x;
 }
 
 void gsm_num_bang(t_gsm_num *x)
 {
-	BASE			*base;
-	float			num = 0.0;
-
-	// iterate channels
-	base = _getBase();		// lock
-	while (base)
-	{
-		num++;
-		base = base->pNext;
-	}
-	_baseUnlock();			// unlock
+	const SNAPSHOT	*snap = _getSnapshot(x->dev, PAGES_CELLS, &x->x_obj);
 
-	outlet_float(x->x_obj.ob_outlet, num);
+	outlet_float(x->partial_out, snap->partial ? 1.0f : 0.0f);
+	outlet_float(x->x_obj.ob_outlet, (float)snap->num);
 }
 
-void *gsm_sort_new(void)
+void *gsm_sort_new(t_symbol *name)
 {
 	t_gsm_sort *x = (t_gsm_sort*)pd_new(c_gsm_sort);
+
+	x->dev = _getDevice(name);				// argument: name of the phone (optional)
 	
 	floatinlet_new(&x->x_obj, &x->num);						// second inlet: zero-based index
 	x->p_out = outlet_new(&x->x_obj, gensym("float"));		// first outlet: power
 	x->chan_out = outlet_new(&x->x_obj, gensym("float"));	// second outlet: channel number
 	x->changed_out = outlet_new(&x->x_obj, gensym("bang"));	// third outlet: bang if channel number has changed
+	x->top_out = outlet_new(&x->x_obj, gensym("list"));		// fourth outlet: strongest cells (see "top")
 
 	return (void*)x;
 }
 
 void gsm_sort_bang(t_gsm_sort *x)
 {
-	BASE			*base;
-	unsigned int	i = 0;
-	unsigned int	num = (unsigned int)x->num;
+	const SNAPSHOT	*snap = _getSnapshot(x->dev, PAGES_CELLS, &x->x_obj);
+	unsigned int	num = (unsigned int)x->num, i;
+	bool			changed;
+	t_atom			list[2*MAX_BASESTATIONS];
 
-	// search for channel
-	base = _getBase();		// lock
-	while (base)
+	if (x->top)
 	{
-		if (i == num)
-			break;
-		i++;
-		base = base->pNext;
+		// "p chan" pairs of the strongest cells, as many as there are
+		for (i=0; i<x->top && i<snap->num; i++)
+		{
+			SETFLOAT(&list[2*i], (float)snap->ranked[i].p);
+			SETFLOAT(&list[2*i+1], (float)snap->ranked[i].channel);
+		}
+		outlet_list(x->top_out, &s_list, 2*i, list);
 	}
 
-	if (base)
+	if (num < snap->num)
 	{
-		float chan = (float)base->channel;
-		outlet_float(x->p_out, (float)base->p);
+		float chan = (float)snap->ranked[num].channel;
+		outlet_float(x->p_out, (float)snap->ranked[num].p);
 		outlet_float(x->chan_out, chan);
-		if (chan != x->prev_chan)
-		{
+		// the flag computed with the scan is only valid if we have seen the one before
+		if (snap->seq == x->prev_seq+1 && num == x->prev_num)
+			changed = snap->changed[num];
+		else
+			changed = (chan != x->prev_chan);
+		x->prev_chan = chan;
+		x->prev_num = num;
+		x->prev_seq = snap->seq;
+		if (changed)
 			outlet_bang(x->changed_out);
-			x->prev_chan = chan;
-		}
 	}
 	else
 	{
 		outlet_float(x->p_out, 0.0);
 		outlet_float(x->chan_out, 0.0);
 	}
+}
+
+void gsm_sort_top(t_gsm_sort *x, t_floatarg f)
+{
+	// "top <k>": output the k strongest cells as a list on every bang, "top 0" turns this off
+	if (f < 0)
+		f = 0;
+	x->top = (f > MAX_BASESTATIONS) ? MAX_BASESTATIONS : (unsigned int)f;
+}
+
+
+void *gsm_tab_new(t_symbol *s, int argc, t_atom *argv)
+{
+	t_gsm_tab *x = (t_gsm_tab*)pd_new(c_gsm_tab);
+	t_symbol *mode;
+
+	// arguments: name of the phone (optional), "power", "channel" or "spectrum", name of the array
+	if (argc > 2 && argv[0].a_type == A_SYMBOL)
+	{
+		x->dev = _getDevice(argv[0].a_w.w_symbol);
+		argc--;
+		argv++;
+	}
+	else
+		x->dev = _getDevice(gensym(""));
+	mode = atom_getsymbolarg(0, argc, argv);
+	if (mode == gensym("channel"))
+		x->mode = TAB_CHANNEL;
+	else if (mode == gensym("spectrum"))
+		x->mode = TAB_SPECTRUM;
+	else
+	{
+		if (mode != gensym("power"))
+			post("gsm_tab: unknown mode %s, using power", mode->s_name);
+		x->mode = TAB_POWER;
+	}
+	x->array = atom_getsymbolarg(1, argc, argv);
+
+	return (void*)x;
+}
+
+void gsm_tab_bang(t_gsm_tab *x)
+{
+	const SNAPSHOT	*snap = _getSnapshot(x->dev, PAGES_CELLS, &x->x_obj);
+	t_garray		*a;
+	t_float			*vec;
+	int				size, i;
+
+	a = (t_garray*)pd_findbyclass(x->array, garray_class);
+	if (!a)
+	{
+		pd_error(x, "gsm_tab: %s: no such array", x->array->s_name);
+		return;
+	}
+	if (!garray_getfloatarray(a, &size, &vec))
+	{
+		pd_error(x, "gsm_tab: %s: bad template", x->array->s_name);
+		return;
+	}
 
-	_baseUnlock();			// unlock
+	// the whole array at once, entries without a cell are 0
+	switch (x->mode)
+	{
+	case TAB_POWER:
+		for (i=0; i<size; i++)
+			vec[i] = ((unsigned int)i < snap->num) ? (t_float)snap->ranked[i].p : 0;
+		break;
+	case TAB_CHANNEL:
+		for (i=0; i<size; i++)
+			vec[i] = ((unsigned int)i < snap->num) ? (t_float)snap->ranked[i].channel : 0;
+		break;
+	case TAB_SPECTRUM:
+		for (i=0; i<size; i++)
+			vec[i] = (i <= MAX_CHANNEL && snap->channels[i].present) ? (t_float)snap->channels[i].p : 0;
+		break;
+	}
+	garray_redraw(a);
 }
 
+void gsm_tab_set(t_gsm_tab *x, t_symbol *array)
+{
+	x->array = array;		// "set <array>": write to another array
+}
+
+void *gsm_stats_new(t_symbol *name)
+{
+	t_gsm_stats *x = (t_gsm_stats*)pd_new(c_gsm_stats);
+
+	x->dev = _getDevice(name);				// argument: name of the phone (optional)
+	x->lastScans = 0;
+	x->lastTime = 0;
+	memset(&x->stats, 0, sizeof(x->stats));
+
+	outlet_new(&x->x_obj, &s_anything);		// outlet: one message per group of counters
+
+	return (void*)x;
+}
 
-void _baseUnlock()
+void gsm_stats_bang(t_gsm_stats *x)
 {
-	ReleaseMutex(g_hMutex);
+	STATS			stats;
+	t_atom			atoms[STATS_RTT];
+	unsigned int	i;
+
+	// the thread may be in the middle of writing, then the counters of the previous bang are repeated
+	if (_getStats(x->dev, &stats))
+		x->stats = stats;
+	else
+		stats = x->stats;
+
+	// scans per second since the last bang (or since opening)
+	if (stats.time < x->lastTime || stats.scans < x->lastScans)
+	{
+		x->lastScans = 0;		// phone has been reopened
+		x->lastTime = 0;
+	}
+	SETFLOAT(&atoms[0], (stats.time > x->lastTime) ? (t_float)(stats.scans - x->lastScans) * 1000 / (stats.time - x->lastTime) : 0);
+	x->lastScans = stats.scans;
+	x->lastTime = stats.time;
+
+	// "rate <scans/s>", "scans <total> <partial> <failed>", "frames <sent> <received> <ACKs sent> <writes>",
+	// "errors <checksum> <bytes discarded> <malformed lines>", "timeouts <security> <3> <4> <5> <11>", "rtt <histogram>"
+	outlet_anything(x->x_obj.ob_outlet, gensym("rate"), 1, atoms);
+	SETFLOAT(&atoms[0], (t_float)stats.scans);
+	SETFLOAT(&atoms[1], (t_float)stats.partial);
+	SETFLOAT(&atoms[2], (t_float)stats.failed);
+	outlet_anything(x->x_obj.ob_outlet, gensym("scans"), 3, atoms);
+	SETFLOAT(&atoms[0], (t_float)stats.framesSent);
+	SETFLOAT(&atoms[1], (t_float)stats.framesReceived);
+	SETFLOAT(&atoms[2], (t_float)stats.acksSent);
+	SETFLOAT(&atoms[3], (t_float)stats.writes);
+	outlet_anything(x->x_obj.ob_outlet, gensym("frames"), 4, atoms);
+	SETFLOAT(&atoms[0], (t_float)stats.checksumErrors);
+	SETFLOAT(&atoms[1], (t_float)stats.bytesDiscarded);
+	SETFLOAT(&atoms[2], (t_float)stats.malformedLines);
+	outlet_anything(x->x_obj.ob_outlet, gensym("errors"), 3, atoms);
+	for (i=0; i<STATS_REQUESTS; i++)
+		SETFLOAT(&atoms[i], (t_float)stats.timeouts[i]);
+	outlet_anything(x->x_obj.ob_outlet, gensym("timeouts"), STATS_REQUESTS, atoms);
+	for (i=0; i<STATS_RTT; i++)
+		SETFLOAT(&atoms[i], (t_float)stats.rtt[i]);
+	outlet_anything(x->x_obj.ob_outlet, gensym("rtt"), STATS_RTT, atoms);
 }
 
 
-BASE *_getBase(void)
+void *gsm_tilde_new(t_symbol *s, int argc, t_atom *argv)
 {
-	DWORD			dwWaitResult;
+	t_gsm_tilde *x = (t_gsm_tilde*)pd_new(c_gsm_tilde);
+	unsigned int i;
 
-	dwWaitResult = WaitForSingleObject(g_hMutex, MUTEX_TIMEOUT);
-	if (dwWaitResult == WAIT_OBJECT_0)
-		return g_pBase;
-	else if (dwWaitResult == WAIT_TIMEOUT)
+	// arguments: name of the phone (optional), number of outlets (default: 1)
+	if (argc && argv[0].a_type == A_SYMBOL)
 	{
-		post("gsm: could not aquire mutex in time");		// DEBUG
+		x->dev = _getDevice(argv[0].a_w.w_symbol);
+		argc--;
+		argv++;
 	}
-	return NULL;		// error: could not aquire mutex in time
+	else
+		x->dev = _getDevice(gensym(""));
+	x->numOut = (unsigned int)atom_getfloatarg(0, argc, argv);
+	if (x->numOut < 1)
+		x->numOut = 1;
+	if (x->numOut > MAX_SIGOUTS)
+		x->numOut = MAX_SIGOUTS;
+
+	for (i=0; i<x->numOut; i++)
+	{
+		x->chan[i] = -1;		// outlet n follows the n-th strongest cell until told otherwise
+		x->rank[i] = i;
+		outlet_new(&x->x_obj, &s_signal);		// outlets: power
+	}
+	x->sr = 44100.0;
+
+	return (void*)x;
+}
+
+void gsm_tilde_free(t_gsm_tilde *x)
+{
+	_traceForget(x->dev, &x->x_obj);
 }
 
+void gsm_tilde_chan(t_gsm_tilde *x, t_floatarg outlet, t_floatarg chan)
+{
+	unsigned int i = (unsigned int)outlet;
 
-bool _getNetmonState(void)
+	if (i < x->numOut && chan >= 0 && chan <= MAX_CHANNEL)
+		x->chan[i] = (int)chan;		// "chan <outlet> <channel>": follow a channel
+}
+
+void gsm_tilde_rank(t_gsm_tilde *x, t_floatarg outlet, t_floatarg rank)
 {
-	DWORD			temp;
+	unsigned int i = (unsigned int)outlet;
 
-	GetExitCodeThread(g_hThread, &temp);
-	if (temp == STILL_ACTIVE)
-		return true;
+	if (i < x->numOut && rank >= 0)
+	{
+		x->chan[i] = -1;			// "rank <outlet> <index>": follow the n-th cell of each scan
+		x->rank[i] = (unsigned int)rank;
+	}
+}
+
+void gsm_tilde_dsp(t_gsm_tilde *x, t_signal **sp)
+{
+	t_int			vec[MAX_SIGOUTS+2];
+	unsigned int	i;
+
+	x->sr = sp[0]->s_sr;
+	vec[0] = (t_int)x;
+	vec[1] = (t_int)sp[0]->s_n;
+	for (i=0; i<x->numOut; i++)
+		vec[i+2] = (t_int)sp[i]->s_vec;
+	dsp_addv(gsm_tilde_perform, x->numOut+2, vec);
+}
+
+t_int *gsm_tilde_perform(t_int *w)
+{
+	t_gsm_tilde		*x = (t_gsm_tilde*)w[1];
+	int				n = (int)w[2];
+	const SNAPSHOT	*snap = _getSnapshot(x->dev, PAGES_CELLS, &x->x_obj);		// lock-free, see _getSnapshot()
+	unsigned int	i, len, ramp;
+	t_sample		*out, cur;
+	int				j;
+
+	if (snap->seq != x->lastSeq)
+	{
+		// new scan: ramp there over the time the last one took, so the output is
+		// a continuous line one scan behind
+		len = x->since;
+		if (!x->lastSeq || len > (unsigned int)x->sr)
+			len = (unsigned int)x->sr;		// first scan or after a gap: at most a second
+		if (len < (unsigned int)n)
+			len = n;
+		for (i=0; i<x->numOut; i++)
+		{
+			if (x->chan[i] >= 0)
+				x->target[i] = snap->channels[x->chan[i]].present ? (t_sample)snap->channels[x->chan[i]].p : 0;
+			else
+				x->target[i] = (x->rank[i] < snap->num) ? (t_sample)snap->ranked[x->rank[i]].p : 0;
+			x->inc[i] = (x->target[i] - x->cur[i]) / len;
+		}
+		x->left = len;
+		x->since = 0;
+		x->lastSeq = snap->seq;
+	}
+
+	ramp = (x->left < (unsigned int)n) ? x->left : n;
+	for (i=0; i<x->numOut; i++)
+	{
+		out = (t_sample*)w[i+3];
+		cur = x->cur[i];
+		for (j=0; j<(int)ramp; j++)
+			out[j] = (cur += x->inc[i]);
+		if (ramp == x->left)
+			cur = x->target[i];		// avoid drifting away by rounding errors
+		for (; j<n; j++)
+			out[j] = cur;
+		x->cur[i] = cur;
+	}
+	x->left -= ramp;
+	if (x->since < 0x7fffffff)
+		x->since += n;
+
+	return w+x->numOut+3;
+}
+
+
+NMDEVICE *_getDevice(t_symbol *name)
+{
+	NMDEVICE		*dev;
+	char			cScan[MAXPDSTRING];
+#ifndef _WIN32
+	int				fds[2];
+#endif
+
+	if (!*name->s_name)
+		name = gensym("gsm");		// objects without a name share this one
+
+	for (dev = g_devices; dev; dev = dev->pNext)
+	{
+		if (dev->name == name)
+			return dev;
+	}
+
+	// first object using this name (devices are never freed, objects keep pointers)
+	dev = (NMDEVICE*)getzbytes(sizeof(NMDEVICE));
+	dev->name = name;
+	strcpy(cScan, "gsm-scan-");
+	strncat(cScan, name->s_name, MAXPDSTRING-10);
+	dev->scan = gensym(cScan);
+	dev->clock = clock_new(dev, (t_method)_deliverScans);
+#ifdef _WIN32
+	dev->thread.clock = dev->clock;
+#else
+	// the thread wakes pd up through a pipe after publishing (see _wakePd())
+	if (pipe(fds) == 0)
+	{
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		sys_addpollfn(fds[0], _wakeScans, dev);
+		dev->thread.wakeFd = fds[1];
+	}
+	else
+	{
+		dev->thread.wakeFd = -1;
+		post("gsm: cannot create pipe, auto mode will not work");
+	}
+#endif
+	dev->snapshots.back = 2;		// all buffers are empty until the first scan
+	dev->snapshots.middle = 1;
+	dev->snapshots.front = 0;
+	dev->thread.tau = 1.0;			// filter defaults, see gsm_filter()
+	dev->thread.q = 10.0;
+	dev->thread.r = 4.0;
+	dev->thread.interval[0] = 0;	// pages 3, 4 and 5 on every scan,
+	dev->thread.interval[1] = 0;
+	dev->thread.interval[2] = 0;
+	dev->thread.interval[3] = -1;	// 0x0b when the serving cell changes
+	dev->thread.timeout = 0;		// adaptive timeouts, see gsm_timeout()
+	dev->thread.budget = SCAN_BUDGET;
+	dev->pNext = g_devices;
+	g_devices = dev;
+	return dev;
+}
+
+
+const SNAPSHOT *_getSnapshot(NMDEVICE *dev, unsigned int pages, const t_object *reader)
+{
+	SNAPSHOTS		*snapshots = &dev->snapshots;
+	unsigned int	i, now;
+
+	// tell the thread which pages are being read (see _schedulePages())
+	if (pages)
+	{
+		now = _getTime();
+		for (i=0; i<NUM_PAGES; i++)
+		{
+			if (pages & (1 << i))
+				ATOMIC_STORE(&dev->thread.demand[i], now);
+		}
+	}
+
+	// pick up the buffer published last, if it is new (only the pd thread calls this)
+	if (ATOMIC_LOAD(&snapshots->middle) & SNAPSHOT_FRESH)
+		snapshots->front = ATOMIC_EXCHANGE(&snapshots->middle, snapshots->front) & ~SNAPSHOT_FRESH;
+	if (dev->thread.trace && reader)
+		_traceRead(dev->thread.trace, &snapshots->buf[snapshots->front], reader);
+	return &snapshots->buf[snapshots->front];
+}
+
+
+void _publishSnapshot(SNAPSHOTS *snapshots)
+{
+	// hand the back buffer over and continue with the one pd gave up
+	snapshots->buf[snapshots->back].seq = ++snapshots->seq;
+	snapshots->back = ATOMIC_EXCHANGE(&snapshots->middle, snapshots->back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+void _deliverScans(NMDEVICE *dev)
+{
+	const SNAPSHOT	*snap = _getSnapshot(dev, 0, NULL);
+
+	// objects in auto mode output a new scan all at once (also if another object
+	// picked it up already)
+	if (snap->seq != dev->lastAuto)
+	{
+		dev->lastAuto = snap->seq;
+		if (dev->scan->s_thing)
+			pd_bang(dev->scan->s_thing);
+	}
+
+	// the thread gave up writing the log (see _logScan())
+	if (ATOMIC_LOAD(&dev->thread.logFailed))
+	{
+		post("gsm: could not write log, recording stopped");
+		_stopLog(dev);
+	}
+}
+
+void _wakePd(NMTHREAD *thread)
+{
+#ifdef _WIN32
+	// pd may be holding its lock while it waits for this thread to stop
+	while (sys_trylock())
+	{
+		if (ATOMIC_LOAD(&thread->stop))
+			return;		// pd calls _deliverScans() itself (see _stopNetmonThread())
+		Sleep(WAKE_WAIT);
+	}
+	clock_delay(thread->clock, 0);
+	sys_unlock();
+#else
+	// a full pipe means pd has not caught up yet, one byte is as good as many
+	if (thread->wakeFd != -1 && write(thread->wakeFd, "", 1) == -1)
+		return;
+#endif
+}
+
+#ifndef _WIN32
+void _wakeScans(void *ptr, int fd)
+{
+	char			buf[64];
+
+	// called by pd when the pipe of a phone is readable (see _wakePd())
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	_deliverScans((NMDEVICE*)ptr);
+}
+#endif
+
+void _logScan(NMTHREAD *thread, const SNAPSHOT *snap)
+{
+	SCANLOG			*log = ATOMIC_LOAD(&thread->log);
+
+	if (!log || ATOMIC_LOAD(&thread->logFailed))
+		return;
+
+	// say which log is in use before checking it is still wanted, pd does the
+	// opposite before closing it (see _stopLog())
+	ATOMIC_STORE(&thread->logging, log);
+	ATOMIC_FENCE();
+	if (ATOMIC_LOAD(&thread->log) == log && appendLog(log, snap->time, snap->cells, snap->num, &snap->loc) != SUCCESS)
+		ATOMIC_STORE(&thread->logFailed, true);
+	ATOMIC_STORE(&thread->logging, (SCANLOG*)NULL);
+}
+
+void _stopLog(NMDEVICE *dev)
+{
+	SCANLOG			*log = dev->thread.log;		// only pd changes it
+
+	if (!log)
+		return;
+	ATOMIC_STORE(&dev->thread.log, (SCANLOG*)NULL);
+	ATOMIC_FENCE();
+
+	// the thread may be in the middle of appending a scan
+	while (ATOMIC_LOAD(&dev->thread.logging) == log)
+	{
+#ifdef _WIN32
+		Sleep(LOG_WAIT);
+#else
+		usleep(LOG_WAIT*1000);
+#endif
+	}
+	closeLog(log);
+	ATOMIC_STORE(&dev->thread.logFailed, false);
+}
+
+void _publishStats(NMTHREAD *thread, MOBILE *mobile)
+{
+	long			seq = thread->statsSeq;		// only the thread writes the counters
+	STATS			stats;
+	const unsigned int	*src = (const unsigned int*)&stats;
+	unsigned int	*dest = (unsigned int*)&thread->stats, i;
+
+	if (mobile)
+		getMobileStats(mobile, &stats);
 	else
+		memset(&stats, 0, sizeof(stats));
+
+	// readers keep their last copy while seq is odd (see _getStats()), STATS is made of words only
+	ATOMIC_EXCHANGE(&thread->statsSeq, seq+1);
+	for (i=0; i<sizeof(STATS)/sizeof(unsigned int); i++)
+		ATOMIC_STORE(&dest[i], src[i]);
+	ATOMIC_STORE(&thread->statsSeq, seq+2);
+}
+
+bool _getStats(NMDEVICE *dev, STATS *dest)
+{
+	long			seq = ATOMIC_LOAD(&dev->thread.statsSeq);
+	const unsigned int	*src = (const unsigned int*)&dev->thread.stats;
+	unsigned int	*words = (unsigned int*)dest, i;
+
+	// copy the counters, false if the thread has been writing them meanwhile
+	if (seq & 1)
+		return false;
+	for (i=0; i<sizeof(STATS)/sizeof(unsigned int); i++)
+		words[i] = ATOMIC_LOAD(&src[i]);
+	ATOMIC_FENCE();		// the copy is complete before checking again
+	return ATOMIC_LOAD(&dev->thread.statsSeq) == seq;
+}
+
+void _publishScan(NMTHREAD *thread)
+{
+	SNAPSHOT		*snap = &thread->snapshots->buf[thread->snapshots->back];	// cells and num already filled in
+	TRACE			*trace;
+	unsigned int	i, now, num;
+
+	snap->loc = thread->loc;
+	snap->time = _getMicros();
+
+	// update the channel table and copy it along
+	now = _getTime();
+	for (i=0; i<thread->numSeen; i++)
+		thread->channels[thread->seen[i]].present = false;
+	thread->numSeen = 0;
+	for (i=0; i<snap->num; i++)
+	{
+		if (snap->cells[i].channel > MAX_CHANNEL)
+			continue;	// BUG: phone reported an invalid channel
+		thread->channels[snap->cells[i].channel].p = snap->cells[i].p;
+		thread->channels[snap->cells[i].channel].present = true;
+		thread->channels[snap->cells[i].channel].lastSeen = now;
+		thread->seen[thread->numSeen++] = snap->cells[i].channel;
+	}
+	memcpy(snap->channels, thread->channels, sizeof(thread->channels));
+
+	_rankScan(thread, snap);
+	_filterScan(thread, snap);
+	_logScan(thread, snap);
+
+	// switch buffers
+	num = snap->num;
+	_publishSnapshot(thread->snapshots);
+	trace = ATOMIC_LOAD(&thread->trace);
+	if (trace)
+		_trace(trace, TRACE_PUBLISH, thread->snapshots->seq, num, NULL, NULL);
+	_wakePd(thread);
+}
+
+void _publishEmpty(SNAPSHOTS *snapshots)
+{
+	SNAPSHOT		*snap = &snapshots->buf[snapshots->back];
+
+	snap->num = 0;
+	snap->time = _getMicros();
+	memset(snap->channels, 0, sizeof(snap->channels));
+	memset(snap->ema, 0, sizeof(snap->ema));
+	memset(snap->median, 0, sizeof(snap->median));
+	memset(snap->kalman, 0, sizeof(snap->kalman));
+	snap->loc.country = 0;
+	snap->loc.network = 0;
+	snap->loc.area = 0;
+	snap->loc.cell = 0;
+	snap->loc.channel = 0;
+	snap->partial = false;
+	_publishSnapshot(snapshots);
+}
+
+void _resetPages(NMTHREAD *thread)
+{
+	unsigned int	i, now = _getTime();
+
+	memset(&thread->pages, 0, sizeof(thread->pages));
+	for (i=0; i<NUM_PAGES; i++)
+	{
+		thread->due[i] = now;
+		thread->adaptive[i] = 0;
+		thread->demand[i] = now;		// everything counts as read until objects say otherwise
+	}
+	thread->locWanted = true;
+}
+
+unsigned int _schedulePages(NMTHREAD *thread)
+{
+	unsigned int	i, now = _getTime(), pages = 0;
+	unsigned int	autoDemand = ATOMIC_LOAD(&thread->autoDemand);
+	bool			autoPages = ATOMIC_LOAD(&thread->autoPages);
+
+	for (i=0; i<NUM_PAGES; i++)
 	{
-		// clean up
-		CloseHandle(g_thread.hSignal);
-		g_thread.hSignal = 0;
-		CloseHandle(g_hThread);
-		g_hThread = 0;
+		if (autoPages && !(autoDemand & (1 << i)) && now - ATOMIC_LOAD(&thread->demand[i]) > DEMAND_TIMEOUT)
+			continue;		// no object has read this page for a while
+		if (i == 3 && thread->locWanted)
+			pages |= PAGE_0B;
+		else if ((autoPages || ATOMIC_LOAD(&thread->interval[i]) >= 0) && (int)(now - thread->due[i]) >= 0)
+			pages |= 1 << i;
+	}
+	return pages;
+}
+
+bool _receivePages(NMTHREAD *thread, const PAGES *pages)
+{
+	SNAPSHOT		*snap = &thread->snapshots->buf[thread->snapshots->back];
+	unsigned int	i, now = _getTime(), serving;
+	int				interval;
+	bool			changed, autoPages = ATOMIC_LOAD(&thread->autoPages);
+
+	if (!pages->received)
 		return false;
+	snap->partial = pages->partial;
+
+	for (i=0; i<NUM_PAGES; i++)
+	{
+		if (!(pages->received & (1 << i)))
+			continue;		// not requested or timed out, try again next time
+
+		// pages which do not change are requested less and less often in automatic mode
+		if (i < 3)
+			changed = (pages->num[i] != thread->pages.num[i] || memcmp(pages->cells[i], thread->pages.cells[i], pages->num[i]*sizeof(CELL)) != 0);
+		else
+			changed = (memcmp(&pages->loc, &thread->pages.loc, sizeof(LOC)) != 0);
+		if (changed)
+			thread->adaptive[i] = 0;
+		else if (thread->adaptive[i] < PAGE_MAXINTERVAL)
+			thread->adaptive[i] = (thread->adaptive[i]) ? thread->adaptive[i]*2 : PAGE_STEP;
+		if (thread->adaptive[i] > PAGE_MAXINTERVAL)
+			thread->adaptive[i] = PAGE_MAXINTERVAL;
+		interval = ATOMIC_LOAD(&thread->interval[i]);
+		thread->due[i] = now + ((autoPages || interval < 0) ? thread->adaptive[i] : (unsigned int)interval);
+
+		if (i < 3)
+		{
+			thread->pages.num[i] = pages->num[i];
+			memcpy(thread->pages.cells[i], pages->cells[i], pages->num[i]*sizeof(CELL));
+		}
+		else
+		{
+			thread->pages.loc = pages->loc;
+			thread->loc = pages->loc;
+			thread->locWanted = false;
+		}
+	}
+
+	// a new serving cell (first one on page 3) asks for page 0x0b
+	if (pages->received & PAGE_3)
+	{
+		serving = thread->pages.num[0] ? thread->pages.cells[0][0].channel : 0;
+		if (serving != thread->pages.loc.channel)
+			thread->locWanted = true;
+	}
+
+	// assemble the scan from the pages as last received, straight into the back buffer
+	snap->num = 0;
+	for (i=0; i<3; i++)
+	{
+		memcpy(snap->cells+snap->num, thread->pages.cells[i], thread->pages.num[i]*sizeof(CELL));
+		snap->num += thread->pages.num[i];
+	}
+	return true;
+}
+
+void _rankScan(NMTHREAD *thread, SNAPSHOT *snap)
+{
+	CELL			cell;
+	unsigned int	i, j;
+
+	// insertion sort by signal strength (smaller p is stronger), stable so that
+	// cells of the same strength stay in the order the phone reported them
+	for (i=0; i<snap->num; i++)
+	{
+		cell = snap->cells[i];
+		for (j=i; j>0 && snap->ranked[j-1].p > cell.p; j--)
+			snap->ranked[j] = snap->ranked[j-1];
+		snap->ranked[j] = cell;
 	}
+
+	// compare with the previous scan, rank by rank
+	for (i=0; i<snap->num; i++)
+		snap->changed[i] = (i >= thread->numRanked || snap->ranked[i].channel != thread->ranked[i].channel);
+	memcpy(thread->ranked, snap->ranked, snap->num * sizeof(CELL));
+	thread->numRanked = snap->num;
 }
 
+void _resetFilters(NMTHREAD *thread)
+{
+	unsigned int	i;
+
+	memset(&thread->filters, 0, sizeof(thread->filters));
+	for (i=0; i<=MAX_CHANNEL; i++)
+		thread->filters.P[i] = KALMAN_PMAX;		// nothing known yet, the first sample is taken as is
+}
 
-bool _startNetmonThread(unsigned int port)
+#define SORT2(a, b)		{ float t = (a < b) ? a : b; b = (a < b) ? b : a; a = t; }
+
+void _filterScan(NMTHREAD *thread, SNAPSHOT *snap)
 {
-	DWORD			dwThreadId;
+	FILTERSTATE		*f = &thread->filters;
+	unsigned long long	time = (thread->replay) ? thread->logTime : snap->time;
+	float			dt, alpha, q, r;
+	unsigned char	*row;
+	unsigned int	i;
+
+	// time since the last scan (replays use the recorded time, so the speed does not matter)
+	dt = (f->time && time > f->time) ? (float)(time - f->time) / 1000000.0f : 0.0f;
+	f->time = time;
+	alpha = 1.0f - (float)exp(-dt / ATOMIC_LOAD(&thread->tau));
+	q = ATOMIC_LOAD(&thread->q) * dt;
+	r = ATOMIC_LOAD(&thread->r);
+
+	// inputs of this scan (missing channels count as 0, just like in gsm_chan)
+	row = f->history[f->pos];
+	for (i=0; i<=MAX_CHANNEL; i++)
+	{
+		f->present[i] = (float)thread->channels[i].present;
+		f->input[i] = f->present[i] * (float)thread->channels[i].p;
+		row[i] = (unsigned char)f->input[i];
+	}
+	f->pos = (f->pos+1) % MEDIAN_N;
+
+	// one pass over all channels, without branches or stores to the snapshot so the compiler can vectorize it
+	for (i=0; i<=MAX_CHANNEL; i++)
+	{
+		float		z = f->input[i], a, P, k;
+
+		// moving average, starting with the first value seen
+		a = (f->ema[i] == 0.0f) ? 1.0f : alpha;
+		f->ema[i] += a * (z - f->ema[i]);
+
+		// Kalman tracker of a constant value: predict, then correct with present channels only
+		P = f->P[i] + q;
+		P = (P < KALMAN_PMAX) ? P : KALMAN_PMAX;
+		k = f->present[i] * (P / (P + r));
+		f->x[i] += k * (z - f->x[i]);
+		f->P[i] = (1.0f - k) * P;
+	}
+	memcpy(snap->ema, f->ema, sizeof(f->ema));
+	memcpy(snap->kalman, f->x, sizeof(f->x));
+
+	// median of the last MEDIAN_N scans, sorting network on every channel
+	for (i=0; i<=MAX_CHANNEL; i++)
+	{
+		float		a = f->history[0][i], b = f->history[1][i], c = f->history[2][i], d = f->history[3][i], e = f->history[4][i];
 
+		SORT2(a, b); SORT2(d, e); SORT2(a, c); SORT2(b, c); SORT2(a, d);
+		SORT2(c, d); SORT2(b, e); SORT2(b, c); SORT2(d, e);
+		f->median[i] = c;
+	}
+	memcpy(snap->median, f->median, sizeof(f->median));
+}
+
+
+bool _getNetmonState(NMDEVICE *dev)
+{
+	if (dev->mobile)
+		return true;		// scanned by the reactor
+	if (!dev->hThread)
+		return false;
+
+#ifdef _WIN32
+	DWORD			temp = 0;
+
+	GetExitCodeThread(dev->hThread, &temp);
+	if (temp == STILL_ACTIVE)
+		return true;
+	// clean up
+	CloseHandle(dev->hThread);
+#else
+	if (pthread_tryjoin_np(dev->hThread, NULL) == EBUSY)
+		return true;
+#endif
+	dev->hThread = 0;
+	return false;
+}
+
+
+bool _startNetmonThread(NMDEVICE *dev, unsigned int port, const char *device)
+{
 	// prepare NMTHREAD struct
-	g_thread.base = &g_pBase;
-	g_thread.hMutex = g_hMutex;
-	g_thread.hSignal = CreateEvent(NULL, false, false, NULL);
-	g_thread.loc = &g_locBuf;
-	g_thread.port = port;
+	dev->thread.snapshots = &dev->snapshots;
+	dev->thread.stop = false;
+	dev->thread.port = port;
+	dev->thread.device = device;
+	memset(dev->thread.channels, 0, sizeof(dev->thread.channels));
+	dev->thread.numSeen = 0;
+	dev->thread.numRanked = 0;
+	memset(&dev->thread.loc, 0, sizeof(dev->thread.loc));
+	_resetFilters(&dev->thread);
+	_resetPages(&dev->thread);
+	dev->thread.replay = NULL;
+
+	return _createThread(dev, netmonThread);
+}
 
+bool _createThread(NMDEVICE *dev, THREADFUNC proc)
+{
 	// create thread
-	g_hThread = CreateThread(NULL, 0, netmonThread, &g_thread, 0, &dwThreadId);
-	if (g_hThread == NULL)
+#ifdef _WIN32
+	DWORD			dwThreadId;
+
+	dev->hThread = CreateThread(NULL, 0, proc, &dev->thread, 0, &dwThreadId);
+	if (dev->hThread == NULL)
 		return false;		// error: cannot create thread
+#else
+	if (pthread_create(&dev->hThread, NULL, proc, &dev->thread) != 0)
+	{
+		dev->hThread = 0;
+		return false;		// error: cannot create thread
+	}
+#endif
+	return true;
+}
+
+void _trace(TRACE *trace, unsigned int point, unsigned int seq, unsigned int arg, const void *reader, const char *name)
+{
+	long			i = ATOMIC_ADD(&trace->head, 1);		// the thread and pd record events
+	TRACEEVENT		*ev = &trace->ring[i & (TRACE_SIZE-1)];
+
+	ATOMIC_EXCHANGE(&ev->stamp, 0);		// being written, before any field changes
+	ev->time = _getMicros();
+	ev->seq = seq;
+	ev->point = (unsigned short)point;
+	ev->arg = (unsigned short)arg;
+	ev->reader = reader;
+	ev->name = name;
+	ATOMIC_STORE(&ev->stamp, i+1);		// after all fields (see _traceDump())
+}
+
+void _traceMobile(MOBILE *mobile, TRACEPOINTS point, unsigned int arg, void *user)
+{
+	NMTHREAD		*thread = (NMTHREAD*)user;
+	TRACE			*trace = ATOMIC_LOAD(&thread->trace);
+
+	// called by the library while scanning, which will be the next snapshot
+	if (trace)
+		_trace(trace, point, thread->snapshots->seq + 1, arg, NULL, NULL);
+}
+
+void _traceRead(TRACE *trace, const SNAPSHOT *snap, const t_object *reader)
+{
+	unsigned int	i, slot = TRACE_READERS;
+
+	// only the first read of each snapshot per object (gsm~ reads on every DSP tick)
+	if (!snap->seq)
+		return;
+	for (i=0; i<TRACE_READERS; i++)
+	{
+		if (trace->readers[i] == reader)
+			break;
+		if (!trace->readers[i] && slot == TRACE_READERS)
+			slot = i;		// first free one, slots are released by _traceForget()
+	}
+	if (i < TRACE_READERS)
+		slot = i;
+	else if (slot == TRACE_READERS)
+		return;		// BUG: too many objects at once, the others are not traced
 	else
-		return true;
+		trace->lastRead[slot] = 0;
+	if (trace->lastRead[slot] == snap->seq)
+		return;
+	trace->readers[slot] = reader;
+	trace->lastRead[slot] = snap->seq;
+	_trace(trace, TRACE_READ, snap->seq, 0, reader, class_getname(pd_class(&reader->te_g.g_pd)));
 }
 
-DWORD WINAPI netmonThread(LPVOID lpParam)
+void _traceForget(NMDEVICE *dev, const t_object *reader)
 {
-	BASE			tempBaseBuf = { 0 };
-	BASE			*cur = &tempBaseBuf;
-	BASE			*pTemp, *pTemp2;
-	DWORD			dwWaitResult;
-	ERRORS			err;
-	NMTHREAD		*thread = (NMTHREAD*)lpParam;
-	unsigned int	prevChan = 0;
+	unsigned int	i;
 
-	err = connectMobile(thread->port);
-	if (err != SUCCESS)
-		return (int)(-1*err);		// error: connectMobile() failed
+	// called when a reader is freed, another object may get its address
+	if (!dev->traceBuf)
+		return;
+	for (i=0; i<TRACE_READERS; i++)
+	{
+		if (dev->traceBuf->readers[i] == reader)
+			dev->traceBuf->readers[i] = NULL;
+	}
+}
 
-	do
+bool _traceDump(TRACE *trace, const char *file, const char *name)
+{
+	FILE				*f;
+	TRACEEVENT			ev;
+	long				i, head = ATOMIC_LOAD(&trace->head);
+	unsigned long long	start = 0, t0 = 0, published[16];
+	unsigned int		startSeq = 0, i16;
+	bool				first = true;
+
+	f = fopen(file, "w");
+	if (!f)
+		return false;
+
+	// one process per phone, its thread (or the reactor) and pd as threads
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"gsm %s\"}},\n", name);
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"netmonitor\"}},\n");
+	fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"pd\"}}");
+	memset(published, 0, sizeof(published));
+
+	for (i = (head > TRACE_SIZE) ? head-TRACE_SIZE : 0; i < head; i++)
 	{
-		err = getBasestations(thread->port, cur);
-		if (err != SUCCESS)
-		{
-			// DEBUG
-			//char debug[256];
-			//sprintf_s(debug, sizeof(debug), "getBasestations() returned %u\n", (unsigned int)err);
-			//OutputDebugString(debug);
+		// skip events being written or overwritten while copying
+		if (ATOMIC_LOAD(&trace->ring[i & (TRACE_SIZE-1)].stamp) != i+1)
 			continue;
-		}
-		
-		if (cur->channel != prevChan)
-		{
-			// call getLocation() if necessary
-			err = getLocation(thread->port, thread->loc);
-			// DEBUG
-			//if (err != SUCCESS)
-			//{
-			//	char debug[256];
-			//	sprintf_s(debug, sizeof(debug), "getLocation() returned %u\n", (unsigned int)err);
-			//	OutputDebugString(debug);
-			//}
-		}
+		ev = trace->ring[i & (TRACE_SIZE-1)];
+		ATOMIC_FENCE();		// the copy is complete before checking again
+		if (ATOMIC_LOAD(&trace->ring[i & (TRACE_SIZE-1)].stamp) != i+1)
+			continue;
+		if (first)
+			t0 = ev.time;		// timestamps start at 0
+		first = false;
+		i16 = ev.seq & 15;
 
-		dwWaitResult = WaitForSingleObject(thread->hMutex, MUTEX_TIMEOUT);
-		if (dwWaitResult == WAIT_OBJECT_0)
+		switch (ev.point)
 		{
-			__try {
-				if (thread->base)			// should always be the case
-				{
-					pTemp2 = *(thread->base);
-					if (pTemp2->pNext)
-					{
-						// free the list currently allocated
-						pTemp = pTemp2->pNext;
-						pTemp2->pNext = NULL;
-						while (pTemp)
-						{
-							pTemp2 = pTemp->pNext;
-							free(pTemp);
-							pTemp = pTemp2;
-						}
-					}
-					// switch buffers
-					pTemp = *(thread->base);
-					*(thread->base) = cur;
-					cur = pTemp;
-				}
-			}
-			__finally
+		case TRACE_REQUEST:
+			if (ev.seq != startSeq)
 			{
-				ReleaseMutex(thread->hMutex);
+				startSeq = ev.seq;		// first request of a scan
+				start = ev.time;
 			}
-		}
-		// DEBUG
-		//else if (dwWaitResult == WAIT_TIMEOUT)
-		//{
-		//	char debug[256];
-		//	sprintf_s(debug, sizeof(debug), "getBasestations() returned %u\n", (unsigned int)err);
-		//	OutputDebugString(debug);
-		//}
-
-		// check signal
-		dwWaitResult = WaitForSingleObject(thread->hSignal, 0L);
-		if (dwWaitResult == WAIT_OBJECT_0)
+			fprintf(f, ",\n{\"name\":\"request\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"scan\":%u,\"page\":\"0x%02x\"}}", ev.time-t0, ev.seq, ev.arg);
+			break;
+		case TRACE_FIRSTBYTE:
+			fprintf(f, ",\n{\"name\":\"first byte\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"scan\":%u,\"bytes\":%u}}", ev.time-t0, ev.seq, ev.arg);
+			break;
+		case TRACE_FRAME:
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"scan\":%u,\"command\":\"0x%02x\"}}", (ev.arg == 0x7f) ? "ack" : "frame", ev.time-t0, ev.seq, ev.arg);
+			break;
+		case TRACE_PUBLISH:
+			// the scan as a whole, from its first request on
+			if (ev.seq == startSeq)
+				fprintf(f, ",\n{\"name\":\"scan\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"scan\":%u}}", start-t0, ev.time-start, ev.seq);
+			fprintf(f, ",\n{\"name\":\"publish\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":1,\"args\":{\"scan\":%u,\"cells\":%u}}", ev.time-t0, ev.seq, ev.arg);
+			published[i16] = ev.time;
+			break;
+		case TRACE_READ:
+			// from being published to being read by this object
+			if (published[i16] && published[i16] <= ev.time)
+				fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":2,\"args\":{\"scan\":%u,\"object\":\"%p\"}}", ev.name, published[i16]-t0, ev.time-published[i16], ev.seq, ev.reader);
+			else
+				fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":2,\"args\":{\"scan\":%u,\"object\":\"%p\"}}", ev.name, ev.time-t0, ev.seq, ev.reader);
 			break;
+		}
 	}
-	while (true);
 
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
+
+unsigned int _getTime(void)
+{
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned int)(ts.tv_sec*1000 + ts.tv_nsec/1000000);
+#endif
+}
+
+unsigned long long _getMicros(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER	count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart * 1000000 + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#endif
+}
 
-	// cleanup
-	dwWaitResult = WaitForSingleObject(thread->hMutex, INFINITE);
-	if (dwWaitResult == WAIT_OBJECT_0)
+THREADPROC netmonThread(void *lpParam)
+{
+	ERRORS			err;
+	NMTHREAD		*thread = (NMTHREAD*)lpParam;
+	MOBILE			*mobile;
+	PAGES			pages;
+	unsigned int	due;
+
+	_publishStats(thread, NULL);		// counters start over
+	if (thread->device)
+		err = openMobile(thread->device, &mobile);
+	else
+		err = openMobilePort(thread->port, &mobile);
+	if (err != SUCCESS)
+		return (THREADRET)(long)(-1*(int)err);		// error: openMobile() failed
+
+	while (!ATOMIC_LOAD(&thread->stop))
 	{
-		// free linked list
-		pTemp = *(thread->base);
-		pTemp = pTemp->pNext;
-		while (pTemp)
+		setMobilePipelining(mobile, ATOMIC_LOAD(&thread->pipeline));
+		setMobileTimeouts(mobile, ATOMIC_LOAD(&thread->timeout), ATOMIC_LOAD(&thread->budget));
+		setMobileTrace(mobile, ATOMIC_LOAD(&thread->trace) ? _traceMobile : NULL, thread);
+
+		due = _schedulePages(thread);
+		if (!due)
 		{
-			pTemp2 = pTemp->pNext;
-			free(pTemp);
-			pTemp = pTemp2;
+			// nothing to do right now
+#ifdef _WIN32
+			Sleep(PAGE_IDLE);
+#else
+			usleep(PAGE_IDLE*1000);
+#endif
+			continue;
 		}
 
-		// switch pointer to global buffer if necessary
-		if (*(thread->base) == &tempBaseBuf)
+		err = getMobilePages(mobile, due, &pages);
+		_publishStats(thread, mobile);		// failures are counted there (see gsm_stats)
+		if (err != SUCCESS && err != E_PARTIAL)
+			continue;
+
+		if (_receivePages(thread, &pages))
+			_publishScan(thread);
+	}
+
+
+	// cleanup: leave an empty snapshot behind
+	_publishEmpty(thread->snapshots);
+	_wakePd(thread);
+
+	closeMobile(mobile);
+
+	return 0;
+}
+
+
+bool _startReplayThread(NMDEVICE *dev, SCANLOG *log, float speed, unsigned int first)
+{
+	// prepare NMTHREAD struct
+	dev->thread.snapshots = &dev->snapshots;
+	dev->thread.stop = false;
+	memset(dev->thread.channels, 0, sizeof(dev->thread.channels));
+	dev->thread.numSeen = 0;
+	dev->thread.numRanked = 0;
+	memset(&dev->thread.loc, 0, sizeof(dev->thread.loc));
+	_resetFilters(&dev->thread);
+	dev->thread.replay = log;
+	dev->thread.speed = speed;
+	dev->thread.first = first;
+
+	return _createThread(dev, replayThread);
+}
+
+THREADPROC replayThread(void *lpParam)
+{
+	NMTHREAD		*thread = (NMTHREAD*)lpParam;
+	SNAPSHOT		*snap;
+	unsigned long long	time, first = 0, start = _getMicros(), due, now;
+	unsigned int	i, numScans = getLogLength(thread->replay);
+
+	_publishStats(thread, NULL);		// nothing is counted while replaying
+	for (i=thread->first; i<numScans && !ATOMIC_LOAD(&thread->stop); i++)
+	{
+		// read straight into the back buffer
+		snap = &thread->snapshots->buf[thread->snapshots->back];
+		if (readLog(thread->replay, i, &time, snap->cells, &snap->num, &thread->loc) != SUCCESS)
+			break;
+		snap->partial = false;
+		if (i == thread->first)
+			first = time;
+		thread->logTime = time;
+
+		if (thread->speed > 0)
 		{
-			pTemp = *(thread->base);
-			*(thread->base) = cur;
-			cur = pTemp;
+			// wait until the scan is due, in steps so "close" is not kept waiting
+			due = start + (unsigned long long)((time - first) / thread->speed);
+			while (!ATOMIC_LOAD(&thread->stop) && (now = _getMicros()) < due)
+			{
+#ifdef _WIN32
+				Sleep((due-now > 10000) ? 10 : (DWORD)((due-now) / 1000));
+#else
+				usleep((due-now > 10000) ? 10000 : (useconds_t)(due-now));
+#endif
+			}
 		}
 
-		// set global buffer to sane values
-		pTemp = *(thread->base);
-		pTemp->channel = 0;
-		pTemp->p = 0;
-		pTemp->pNext = NULL;
+		_publishScan(thread);
 	}
-	ReleaseMutex(thread->hMutex);
 
-	disconnectMobile(thread->port);
+
+	// cleanup: leave an empty snapshot behind
+	_publishEmpty(thread->snapshots);
+	_wakePd(thread);
+
+	closeLog(thread->replay);
 
 	return 0;
 }
 
 
-void _stopNetmonThread(void)
+void _stopNetmonThread(NMDEVICE *dev)
 {
-	DWORD			ret;
+	unsigned int	wait;
+
+#ifndef _WIN32
+	if (dev->mobile)
+	{
+		// take the phone away from the reactor, then publish from here
+		removeMobile(g_reactor, dev->mobile);
+		closeMobile(dev->mobile);
+		dev->mobile = NULL;
+		_publishEmpty(&dev->snapshots);
+		clock_delay(dev->clock, 0);		// objects in auto mode output the empty snapshot
+		return;
+	}
+#endif
+	if (!dev->hThread)
+		return;
 
-	// send event (polite)
-	SetEvent(g_thread.hSignal);
+	// ask politely, a scan in progress takes up to its budget to end
+	ATOMIC_STORE(&dev->thread.stop, true);
+	wait = (dev->thread.budget ? dev->thread.budget : SCAN_BUDGET) + CLOSE_WAIT;
+
+#ifdef _WIN32
 	// wait for thread to exit
-	ret = WaitForSingleObject(g_hThread, 1000);
-	if (ret == WAIT_TIMEOUT)
+	if (WaitForSingleObject(dev->hThread, wait) == WAIT_TIMEOUT)
 	{
 		// kill thread the hard way (quite dangerous)
-		TerminateThread(g_hThread, -19);
+		TerminateThread(dev->hThread, -19);
 		post("gsm: terminating thread the hard way");
 	}
 	// clean up
-	CloseHandle(g_thread.hSignal);
-	g_thread.hSignal = 0;
-	CloseHandle(g_hThread);
-	g_hThread = 0;
-}
\ No newline at end of file
+	CloseHandle(dev->hThread);
+#else
+	struct timespec ts;
+
+	// wait for thread to exit
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += wait / 1000;
+	ts.tv_nsec += (long)(wait % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	if (pthread_timedjoin_np(dev->hThread, NULL, &ts) == ETIMEDOUT)
+	{
+		// kill thread the hard way (quite dangerous)
+		pthread_cancel(dev->hThread);
+		pthread_join(dev->hThread, NULL);
+		post("gsm: terminating thread the hard way");
+	}
+#endif
+	dev->thread.logging = NULL;		// a thread killed while writing does not say so any more
+	dev->hThread = 0;
+	clock_delay(dev->clock, 0);		// objects in auto mode output the empty snapshot the thread left
+}
+
+
+bool _startNetmonReactor(NMDEVICE *dev, unsigned int port, const char *device)
+{
+#ifdef _WIN32
+	return false;
+#else
+	ERRORS			err;
+
+	if (!g_reactor && createReactor(&g_reactor) != SUCCESS)
+		return false;		// error: cannot create reactor
+
+	// prepare NMTHREAD struct (the reactor only uses what is needed for publishing)
+	dev->thread.snapshots = &dev->snapshots;
+	dev->thread.port = port;
+	dev->thread.device = device;
+	memset(dev->thread.channels, 0, sizeof(dev->thread.channels));
+	dev->thread.numSeen = 0;
+	dev->thread.numRanked = 0;
+	memset(&dev->thread.loc, 0, sizeof(dev->thread.loc));
+	_resetFilters(&dev->thread);
+	_publishStats(&dev->thread, NULL);		// the reactor does not know the phone yet, so pd is the only writer
+	_resetPages(&dev->thread);
+
+	if (device)
+		err = openMobile(device, &dev->mobile);
+	else
+		err = openMobilePort(port, &dev->mobile);
+	if (err != SUCCESS)
+	{
+		dev->mobile = NULL;
+		return false;		// error: openMobile() failed
+	}
+	setMobilePipelining(dev->mobile, dev->thread.pipeline);
+	setMobileTimeouts(dev->mobile, dev->thread.timeout, dev->thread.budget);
+	setMobileTrace(dev->mobile, dev->thread.trace ? _traceMobile : NULL, &dev->thread);
+	setMobilePages(dev->mobile, _schedulePages(&dev->thread));
+
+	if (addMobile(g_reactor, dev->mobile, netmonScan, &dev->thread) != SUCCESS)
+	{
+		closeMobile(dev->mobile);
+		dev->mobile = NULL;
+		return false;		// error: cannot watch port
+	}
+	return true;
+#endif
+}
+
+void netmonScan(MOBILE *mobile, ERRORS err, const PAGES *pages, void *user)
+{
+	NMTHREAD		*thread = (NMTHREAD*)user;
+
+	// called by the reactor thread after each scan (errors keep the last scan, like
+	// netmonThread()), the next one uses the current settings
+	_publishStats(thread, mobile);
+	if ((err == SUCCESS || err == E_PARTIAL) && _receivePages(thread, pages))
+		_publishScan(thread);
+
+	setMobilePipelining(mobile, ATOMIC_LOAD(&thread->pipeline));
+	setMobileTimeouts(mobile, ATOMIC_LOAD(&thread->timeout), ATOMIC_LOAD(&thread->budget));
+	setMobileTrace(mobile, ATOMIC_LOAD(&thread->trace) ? _traceMobile : NULL, thread);
+	setMobilePages(mobile, _schedulePages(thread));
+}
@@ -12,37 +12,134 @@
 #ifndef PD_GSM_H
 #define PD_GSM_H
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 #include "m_pd.h"								// for t_class, etc
 #include "libNokiaNetmon/libNokiaNetmon.h"		// for BASE
 
+#ifndef _WIN32
+// from s_stuff.h of pd, which m_pd.h of pd 0.39 does not declare
+extern "C" {
+typedef void (*t_fdpollfn)(void *ptr, int fd);
+EXTERN void sys_addpollfn(int fd, t_fdpollfn fn, void *ptr);
+}
+#endif
+
+#ifdef _WIN32
 #define EXP extern "C" __declspec (dllexport)
+typedef HANDLE			THREAD;
+typedef DWORD			THREADRET;
+#define THREADPROC		DWORD WINAPI
+typedef LPTHREAD_START_ROUTINE	THREADFUNC;
+#define ATOMIC_EXCHANGE(p, v)	InterlockedExchange((p), (v))
+#define ATOMIC_ADD(p, v)		InterlockedExchangeAdd((p), (v))		// returns the value before
+#define ATOMIC_FENCE()			MemoryBarrier()
+#else
+#define EXP extern "C" __attribute__ ((visibility ("default")))
+typedef pthread_t		THREAD;
+typedef void*			THREADRET;
+#define THREADPROC		void*
+typedef void*			(*THREADFUNC)(void*);
+#define ATOMIC_EXCHANGE(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_ADD(p, v)		__atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define ATOMIC_FENCE()			__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+#define ATOMIC_STORE(p, v)		_atomicStore((p), (v))		// release: writes before it are visible first
+#define ATOMIC_LOAD(p)			_atomicLoad(p)				// acquire: reads after it see what was released
+
+// fields shared by pd and the thread of a phone (any word sized type, floats included)
+template <class T, class V> inline void _atomicStore(volatile T *p, V v)
+{
+	T t = (T)v;
+#ifdef _WIN32
+	MemoryBarrier();
+	*p = t;
+#else
+	__atomic_store((T*)p, &t, __ATOMIC_RELEASE);
+#endif
+}
+template <class T> inline T _atomicLoad(const volatile T *p)
+{
+	T t;
+#ifdef _WIN32
+	t = *p;
+	MemoryBarrier();
+#else
+	__atomic_load((const T*)p, &t, __ATOMIC_ACQUIRE);
+#endif
+	return t;
+}
+
+#define SNAPSHOT_FRESH	4L		// flag in SNAPSHOTS.middle: buffer has been published but not read yet
+#define MAX_CHANNEL		1023	// highest GSM channel number (ARFCN)
+#define MAX_SIGOUTS		16		// maximum number of signal outlets of gsm~
+#define MEDIAN_N		5		// number of scans the median filter looks at (the sorting network in _filterScan() is made for 5)
+#define KALMAN_PMAX		1.0e6f	// upper bound of the Kalman variance, reached by channels not seen for long
+#define NUM_PAGES		4		// pages being scheduled: 3, 4, 5 and 0x0b (bit n of the PAGE_* flags)
+#define PAGE_IDLE		10		// miliseconds the thread waits when no page is due
+#define PAGE_STEP		50		// miliseconds an unchanged page is requested later in automatic mode, doubled every time
+#define PAGE_MAXINTERVAL	1000	// miliseconds between requests of an unchanging page in automatic mode, at most
+#define DEMAND_TIMEOUT	2000	// miliseconds a page is still requested after an object last read it (automatic mode)
+#define SCAN_BUDGET		1000	// miliseconds a scan may take by default (see gsm_timeout())
+#define WAKE_WAIT		1		// miliseconds the thread waits for pd's lock before trying again (Win32, see _wakePd())
+#define LOG_WAIT		1		// miliseconds pd waits for the thread to finish writing a scan when recording stops
+#define CLOSE_WAIT		500		// miliseconds the thread is waited for on "close", in addition to the scan budget
+#define TRACE_SIZE		4096	// events kept by the trace ring of a phone (power of two)
+#define TRACE_READERS	64		// objects whose first read of each snapshot is traced
+#define TRACE_PUBLISH	16		// trace point: snapshot published (following the TRACEPOINTS of the library)
+#define TRACE_READ		17		// trace point: snapshot read by an object for the first time
+
+// filters run by the Netmonitor thread on every channel (see gsm_avg)
+typedef enum
+{
+	FILTER_EMA,					// exponential moving average with a time constant
+	FILTER_MEDIAN,				// median of the last MEDIAN_N scans
+	FILTER_KALMAN				// Kalman tracker, holds the estimate while a channel is missing
+} FILTERS;
 
 
 //	Structs
 
 
+struct NMDEVICE;				// a phone, shared by all objects created with the same name (see below)
+
 static t_class	*c_gsm;			// "class" for opening/closing a connection
 typedef struct _gsm {
 	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
 } t_gsm;
 
+typedef struct _gsm_obj {		// beginning common to all objects below which can be in auto mode
+	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	bool		automode;		// output on every new scan instead of on bang
+} t_gsm_obj;
+
 static t_class	*c_gsm_avg;		// class for calculating a moving average
 typedef struct _gsm_avg {
 	t_object	x_obj;
-	t_float		avg;			// current average
+	NMDEVICE	*dev;			// phone
+	bool		automode;		// output on every new scan instead of on bang
+	FILTERS		filter;			// filter whose output is returned
 	t_float		chan;			// channel number
-	t_float		pt;				// n-point average
 } t_gsm_avg;
 
 static t_class	*c_gsm_chan;	// class for returning the value of a given channel
 typedef struct _gsm_chan {
 	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	bool		automode;		// output on every new scan instead of on bang
 	t_float		chan;			// channel number
 } t_gsm_chan;
 
 static t_class	*c_gsm_loc;		// class for returning position information
 typedef struct _gsm_loc {
 	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	bool		automode;		// output on every new scan instead of on bang
 	t_outlet	*country_out;	// Mobile Country Code (MCC, Austria is 232)
 	t_outlet	*network_out;	// Mobile Network Code (MNC, yesss! is 5 in Austria)
 	t_outlet	*area_out;		// Location Area {Identifier,Code} (LAI/LAC)
@@ -52,25 +149,193 @@ typedef struct _gsm_loc {
 static t_class	*c_gsm_num;		// class for returning number of channels
 typedef struct _gsm_num {
 	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	bool		automode;		// output on every new scan instead of on bang
+	t_outlet	*partial_out;	// 1 if some pages of the scan timed out and are from earlier scans
 } t_gsm_num;
 
 static t_class	*c_gsm_sort;	// class for returning sorted value/channel pairs
 typedef struct _gsm_sort {
 	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	bool		automode;		// output on every new scan instead of on bang
 	t_float		num;			// zero-based index
 	t_float		prev_chan;		// previous channel
+	unsigned int prev_num;		// index used for the previous output
+	unsigned int prev_seq;		// number of the snapshot used for the previous output
+	unsigned int top;			// number of cells output by "top", 0 if off
 	t_outlet	*p_out;			// power
 	t_outlet	*chan_out;		// channel number
 	t_outlet	*changed_out;	// bang if channel number has changed
+	t_outlet	*top_out;		// list of power and channel of the strongest cells
 } t_gsm_sort;
 
-struct NMTHREAD					// struct that is being passed to the Netmonitor thread
+typedef enum
+{
+	TAB_POWER,					// power by rank
+	TAB_CHANNEL,				// channel number by rank
+	TAB_SPECTRUM				// power indexed by channel number
+} TABMODE;
+
+static t_class	*c_gsm_tab;		// class for writing whole scans into arrays
+typedef struct _gsm_tab {
+	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	bool		automode;		// output on every new scan instead of on bang
+	TABMODE		mode;			// what is written
+	t_symbol	*array;			// name of the array
+} t_gsm_tab;
+
+static t_class	*c_gsm_stats;	// class for outputting the counters of a phone
+typedef struct _gsm_stats {
+	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	unsigned int	lastScans;	// scans counted at the previous bang, for the rate
+	unsigned int	lastTime;	// time of the previous bang (see STATS)
+	STATS		stats;			// counters as last read, kept while the thread is writing them
+} t_gsm_stats;
+
+static t_class	*c_gsm_tilde;	// class for outputting signal levels as audio signals
+typedef struct _gsm_tilde {
+	t_object	x_obj;
+	NMDEVICE	*dev;			// phone
+	unsigned int numOut;		// number of signal outlets
+	int			chan[MAX_SIGOUTS];	// channel number per outlet, -1 if the outlet follows a rank
+	unsigned int rank[MAX_SIGOUTS];	// zero-based index into the scan per outlet (if chan is -1)
+	t_sample	cur[MAX_SIGOUTS];	// current value per outlet
+	t_sample	target[MAX_SIGOUTS];// value of the last scan per outlet
+	t_sample	inc[MAX_SIGOUTS];	// increment per sample while ramping towards target
+	unsigned int left;			// samples left until all outlets reach their target
+	unsigned int since;			// samples since the last scan arrived
+	float		sr;				// sample rate
+	unsigned int lastSeq;		// number of the snapshot seen by the last perform call
+} t_gsm_tilde;
+
+typedef struct					// entry of the channel table, indexed by channel number
+{
+	unsigned short	p;			// signal strength in -p dBm when last seen
+	bool			present;	// seen in the current scan
+	unsigned int	lastSeen;	// time of the last scan that saw this channel (see _getTime()), 0 if never
+} CHANNEL;
+
+typedef struct					// result of a single scan, not modified after being published
+{
+	unsigned int	seq;					// number of the snapshot, counting from 1 (0: nothing published yet)
+	unsigned long long	time;				// when it was published, in microseconds (see _getMicros())
+	unsigned int	num;					// number of valid entries in cells
+	CELL			cells[MAX_BASESTATIONS];// channels and signal levels as ordered by the phone
+	CELL			ranked[MAX_BASESTATIONS];// the same sorted by signal strength, strongest first
+	bool			changed[MAX_BASESTATIONS];// channel at this rank differs from the previous scan
+	CHANNEL			channels[MAX_CHANNEL+1];// the same by channel number, for lookups
+	float			ema[MAX_CHANNEL+1];		// filtered signal strength by channel number (see FILTERS)
+	float			median[MAX_CHANNEL+1];
+	float			kalman[MAX_CHANNEL+1];
+	LOC				loc;					// serving cell
+	bool			partial;				// some pages timed out, their cells are from earlier scans (see E_PARTIAL)
+} SNAPSHOT;
+
+struct SNAPSHOTS				// triple buffer passing snapshots from the Netmonitor thread to pd
 {
-	BASE			**base;		// pointer to a BASE pointer
-	HANDLE			hMutex;		// mutex protecting that pointer
-	HANDLE			hSignal;	// signal handle to end this thread
-	LOC				*loc;		// pointer to a LOC struct being filled
+	SNAPSHOT		buf[3];
+	long			back;		// index of the buffer being filled by the thread
+	volatile long	middle;		// index of the buffer last published (| SNAPSHOT_FRESH if it has not been picked up yet)
+	long			front;		// index of the buffer pd objects read from
+	unsigned int	seq;		// number of snapshots published so far (only used by the publishing thread)
+};
+
+typedef struct					// entry of the trace ring
+{
+	unsigned long long	time;	// when it happened, in microseconds (see _getMicros())
+	unsigned int	seq;		// number of the snapshot being scanned, published or read
+	unsigned short	point;		// TRACEPOINTS of the library, TRACE_PUBLISH or TRACE_READ
+	unsigned short	arg;		// see TRACEPOINTS
+	const void		*reader;	// object (TRACE_READ)
+	const char		*name;		// its class (TRACE_READ)
+	volatile long	stamp;		// index of the event + 1, written last (see _traceDump())
+} TRACEEVENT;
+
+typedef struct					// events of a phone being traced, written by its thread and by pd (see gsm_trace())
+{
+	TRACEEVENT		ring[TRACE_SIZE];
+	volatile long	head;		// events recorded so far, the latest TRACE_SIZE are kept
+	const void		*readers[TRACE_READERS];	// objects which have read snapshots, NULL once freed (pd thread only)
+	unsigned int	lastRead[TRACE_READERS];	// number of the snapshot they read last
+} TRACE;
+
+typedef struct					// filter state of all channels, kept from scan to scan by the thread
+{
+	float			present[MAX_CHANNEL+1];	// 1 if a channel is in the current scan, else 0
+	float			input[MAX_CHANNEL+1];	// signal strength in the current scan, 0 if missing
+	float			ema[MAX_CHANNEL+1];		// exponential moving average
+	unsigned char	history[MEDIAN_N][MAX_CHANNEL+1];	// inputs of the last scans, for the median
+	unsigned int	pos;					// row of history written next
+	float			median[MAX_CHANNEL+1];	// median of history
+	float			x[MAX_CHANNEL+1];		// Kalman estimate
+	float			P[MAX_CHANNEL+1];		// Kalman variance
+	unsigned long long	time;				// time of the last scan (see _getMicros()), 0 if none
+} FILTERSTATE;
+
+struct NMTHREAD					// struct that is being passed to the Netmonitor thread (or the reactor)
+{
+	SNAPSHOTS		*snapshots;	// where scans are published
+	// options set by pd while the thread runs, accessed with ATOMIC_STORE()/ATOMIC_LOAD()
+	bool			stop;		// set to end this thread
+	bool			pipeline;	// request Netmonitor pages back to back (see setMobilePipelining())
+	unsigned int	timeout;	// miliseconds per request, 0 to adapt to the round trip time (see setMobileTimeouts())
+	unsigned int	budget;		// miliseconds per scan, 0 for no limit
+	int				interval[NUM_PAGES];	// miliseconds between requests per page, 0 for every scan, -1 for never (see gsm_page())
+	bool			autoPages;	// only request pages objects read, more often if they change (see gsm_autopage())
+	unsigned int	demand[NUM_PAGES];	// time an object last read a page (see _getTime()), set by pd
+	unsigned int	autoDemand;	// PAGE_* flags of the pages objects in auto mode read, always demanded (see gsm_obj_auto())
+	PAGES			pages;		// pages as last received
+	unsigned int	due[NUM_PAGES];			// time a page is requested next
+	unsigned int	adaptive[NUM_PAGES];	// current interval per page in automatic mode
+	bool			locWanted;	// request page 0x0b, the serving cell has changed
 	unsigned int	port;		// COM port to be used
+	const char		*device;	// serial device to be opened (NULL for the port's default)
+	CHANNEL			channels[MAX_CHANNEL+1];	// channel table carried from scan to scan
+	unsigned short	seen[MAX_BASESTATIONS];		// channels present in the previous scan
+	unsigned int	numSeen;	// number of entries in seen
+	LOC				loc;		// serving cell as last received
+	CELL			ranked[MAX_BASESTATIONS];	// cells of the previous scan by rank
+	unsigned int	numRanked;	// number of entries in ranked
+	FILTERSTATE		filters;	// per-channel filters
+	STATS			stats;		// counters of the phone, copied after every scan (see _publishStats())
+	volatile long	statsSeq;	// incremented before and after stats is written, odd while writing
+	TRACE			*trace;		// where events are recorded while tracing, NULL otherwise (set by pd, see gsm_trace())
+	float			tau;		// time constant of the moving average in seconds (set by pd, see gsm_filter())
+	float			q;			// Kalman process noise in dB^2 per second
+	float			r;			// Kalman measurement noise in dB^2
+	SCANLOG			*replay;	// log being replayed instead of polling a phone (owned by the thread)
+	float			speed;		// replay speed, 0 for as fast as possible
+	unsigned int	first;		// index of the first scan to replay
+	unsigned long long	logTime;	// time the scan being replayed was recorded, used by the filters
+	SCANLOG			*log;		// scans are appended to while recording, NULL if none (set by pd, see gsm_record())
+	SCANLOG			*logging;	// log being appended to right now, NULL otherwise (see _stopLog())
+	bool			logFailed;	// a scan could not be written, pd stops recording (see _deliverScans())
+#ifdef _WIN32
+	t_clock			*clock;		// clock of the device, set from the thread under pd's lock (see _wakePd())
+#else
+	int				wakeFd;		// pipe to pd, a byte is written after publishing (see _wakePd())
+#endif
+};
+
+struct NMDEVICE					// a phone as seen from pd, one per name given to the objects
+{
+	t_symbol		*name;		// e.g. "a" for [gsm a], [gsm_chan a], ...
+	SNAPSHOTS		snapshots;	// scans published by the thread
+	NMTHREAD		thread;		// parameters of the thread
+	THREAD			hThread;	// Netmonitor thread polling the phone, 0 if none
+	bool			reactor;	// scan with the shared reactor instead of a thread of its own (POSIX only)
+	struct _gsm		*owner;		// object whose "open" started scanning, freeing it closes the phone
+	t_symbol		*scan;		// bound by objects in auto mode, banged once per new scan
+	t_clock			*clock;		// runs _deliverScans() when the thread has published (Win32) or stopped
+	unsigned int	numAuto;	// number of objects in auto mode
+	unsigned int	numAutoLoc;	// of which are gsm_loc objects (see _deliverScans())
+	unsigned int	lastAuto;	// number of the snapshot last output by objects in auto mode
+	MOBILE			*mobile;	// phone handed to the reactor, NULL if none
+	TRACE			*traceBuf;	// allocated by the first "trace 1", never freed
+	NMDEVICE		*pNext;		// next device
 };
 
 
@@ -84,33 +349,97 @@ EXP void gsm_setup(void);
 
 
 // gsm class
-void *gsm_new(void);
+void *gsm_new(t_symbol *name);
+void gsm_free(t_gsm *x);
 void gsm_close(t_gsm *x);
-void gsm_open(t_gsm *x, t_floatarg f);
+void gsm_open(t_gsm *x, t_symbol *s, int argc, t_atom *argv);
+void gsm_pipeline(t_gsm *x, t_floatarg f);
+void gsm_timeout(t_gsm *x, t_floatarg request, t_floatarg scan);
+void gsm_page(t_gsm *x, t_floatarg page, t_floatarg interval);
+void gsm_autopage(t_gsm *x, t_floatarg f);
+void gsm_reactor(t_gsm *x, t_floatarg f);
+void gsm_filter(t_gsm *x, t_floatarg tau, t_floatarg q, t_floatarg r);
+void gsm_record(t_gsm *x, t_symbol *file);
+void gsm_replay(t_gsm *x, t_symbol *s, int argc, t_atom *argv);
+void gsm_trace(t_gsm *x, t_symbol *s, int argc, t_atom *argv);
+// objects which can be in auto mode
+void gsm_obj_auto(t_gsm_obj *x, t_floatarg f);
+void gsm_obj_free(t_gsm_obj *x);
 // gsm_avg class
-void *gsm_avg_new(void);
+void *gsm_avg_new(t_symbol *name);
 void gsm_avg_bang(t_gsm_avg *x);
+void gsm_avg_ema(t_gsm_avg *x);
+void gsm_avg_median(t_gsm_avg *x);
+void gsm_avg_kalman(t_gsm_avg *x);
+void gsm_avg_pt(t_gsm_avg *x, t_floatarg f);
 // gsm_chan class
-void *gsm_chan_new(void);
+void *gsm_chan_new(t_symbol *name);
 void gsm_chan_bang(t_gsm_chan *x);
 // gsm_loc class
-void *gsm_loc_new(void);
+void *gsm_loc_new(t_symbol *name);
 void gsm_loc_bang(t_gsm_loc *x);
 void gsm_loc_free(t_gsm *x);
 // gsm_num class
-void *gsm_num_new(void);
+void *gsm_num_new(t_symbol *name);
 void gsm_num_bang(t_gsm_num *x);
 // gsm_sort class
-void *gsm_sort_new(void);
+void *gsm_sort_new(t_symbol *name);
 void gsm_sort_bang(t_gsm_sort *x);
-// locking
-void _baseUnlock();
-BASE *_getBase(void);
+void gsm_sort_top(t_gsm_sort *x, t_floatarg f);
+// gsm_tab class
+void *gsm_tab_new(t_symbol *s, int argc, t_atom *argv);
+void gsm_tab_bang(t_gsm_tab *x);
+void gsm_tab_set(t_gsm_tab *x, t_symbol *array);
+// gsm_stats class
+void *gsm_stats_new(t_symbol *name);
+void gsm_stats_bang(t_gsm_stats *x);
+// gsm~ class
+void *gsm_tilde_new(t_symbol *s, int argc, t_atom *argv);
+void gsm_tilde_free(t_gsm_tilde *x);
+void gsm_tilde_chan(t_gsm_tilde *x, t_floatarg outlet, t_floatarg chan);
+void gsm_tilde_rank(t_gsm_tilde *x, t_floatarg outlet, t_floatarg rank);
+void gsm_tilde_dsp(t_gsm_tilde *x, t_signal **sp);
+t_int *gsm_tilde_perform(t_int *w);
+// devices and snapshots
+NMDEVICE *_getDevice(t_symbol *name);
+const SNAPSHOT *_getSnapshot(NMDEVICE *dev, unsigned int pages, const t_object *reader);
+void _publishSnapshot(SNAPSHOTS *snapshots);
+void _publishScan(NMTHREAD *thread);
+void _rankScan(NMTHREAD *thread, SNAPSHOT *snap);
+void _resetFilters(NMTHREAD *thread);
+void _filterScan(NMTHREAD *thread, SNAPSHOT *snap);
+void _publishEmpty(SNAPSHOTS *snapshots);
+void _resetPages(NMTHREAD *thread);
+unsigned int _schedulePages(NMTHREAD *thread);
+bool _receivePages(NMTHREAD *thread, const PAGES *pages);
+void _deliverScans(NMDEVICE *dev);
+void _wakePd(NMTHREAD *thread);
+#ifndef _WIN32
+void _wakeScans(void *ptr, int fd);
+#endif
+void _logScan(NMTHREAD *thread, const SNAPSHOT *snap);
+void _stopLog(NMDEVICE *dev);
+void _publishStats(NMTHREAD *thread, MOBILE *mobile);
+bool _getStats(NMDEVICE *dev, STATS *dest);
+// tracing
+void _trace(TRACE *trace, unsigned int point, unsigned int seq, unsigned int arg, const void *reader, const char *name);
+void _traceMobile(MOBILE *mobile, TRACEPOINTS point, unsigned int arg, void *user);
+void _traceRead(TRACE *trace, const SNAPSHOT *snap, const t_object *reader);
+void _traceForget(NMDEVICE *dev, const t_object *reader);
+bool _traceDump(TRACE *trace, const char *file, const char *name);
 // netmonitor thread
-bool _getNetmonState(void);
-bool _startNetmonThread(unsigned int port);
-DWORD WINAPI netmonThread(LPVOID lpParam);
-void _stopNetmonThread(void);
+unsigned int _getTime(void);
+unsigned long long _getMicros(void);
+bool _getNetmonState(NMDEVICE *dev);
+bool _createThread(NMDEVICE *dev, THREADFUNC proc);
+bool _startNetmonThread(NMDEVICE *dev, unsigned int port, const char *device);
+THREADPROC netmonThread(void *lpParam);
+bool _startReplayThread(NMDEVICE *dev, SCANLOG *log, float speed, unsigned int first);
+THREADPROC replayThread(void *lpParam);
+void _stopNetmonThread(NMDEVICE *dev);
+// reactor
+bool _startNetmonReactor(NMDEVICE *dev, unsigned int port, const char *device);
+void netmonScan(MOBILE *mobile, ERRORS err, const PAGES *pages, void *user);
 
 
 #endif		// PD_GSM_H
\ No newline at end of file